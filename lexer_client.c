@@ -0,0 +1,350 @@
+/* File: lexer_client.c
+   Thin client for the persistent analyzer server (lexer --serve SOCKET).
+   Sends all files over one connection in batches and prints the reports in order,
+   so a build can call it instead of starting a full analyzer per file.
+
+   Compile:
+     gcc lexer_client.c -o lexer_client -O2 -pthread
+
+   Run:
+     ./lexer_client [-s SOCKET] [--format box|tsv|summary|docs] [--lang java|kotlin|auto] FILE...
+         (FILE "-" sends stdin as an in-memory buffer)
+     ./lexer_client [-s SOCKET] --load [-c CLIENTS] [-n REQUESTS] [--format F] FILE...
+         (load test: latency percentiles and throughput)
+
+   SOCKET defaults to $LEXER_SOCKET, then /tmp/lexer.sock.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BATCH 64 /* requests in flight per connection before reading replies */
+
+static const char *sock_path;
+static const char *fmt_s = "box";
+static const char *lang_s = "auto";
+
+/* connection to the server as a pair of buffered streams */
+struct Conn
+{
+    FILE *in;
+    FILE *out;
+};
+
+static int conn_open(struct Conn *c)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+    if (!(c->in = fdopen(fd, "r")))
+    {
+        close(fd);
+        return 0;
+    }
+    int out_fd = dup(fd);
+    if (out_fd < 0 || !(c->out = fdopen(out_fd, "w")))
+    {
+        if (out_fd >= 0)
+            close(out_fd);
+        fclose(c->in);
+        return 0;
+    }
+    return 1;
+}
+
+/* release the connection without a goodbye (it is broken) */
+static void conn_drop(struct Conn *c)
+{
+    fclose(c->out);
+    fclose(c->in);
+}
+
+static void conn_close(struct Conn *c)
+{
+    fprintf(c->out, "QUIT\n");
+    conn_drop(c);
+}
+
+/* send a PATH request (absolute path: the server has its own working directory) */
+static void send_path(struct Conn *c, const char *file)
+{
+    char *abs = realpath(file, NULL);
+    fprintf(c->out, "%s %s PATH %s\n", lang_s, fmt_s, abs ? abs : file);
+    free(abs);
+}
+
+/* read one reply; the report goes to sink (or is discarded when sink is NULL).
+   Returns 1 on OK, 0 on ERR, -1 if the connection broke. */
+static int read_reply(struct Conn *c, FILE *sink)
+{
+    char line[4096];
+    if (!fgets(line, sizeof(line), c->in))
+        return -1;
+    if (strncmp(line, "OK ", 3) != 0)
+    {
+        fprintf(stderr, "%s", line);
+        return strncmp(line, "ERR", 3) == 0 ? 0 : -1;
+    }
+    long n = atol(line + 3);
+    char chunk[65536];
+    while (n > 0)
+    {
+        size_t want = n < (long)sizeof(chunk) ? (size_t)n : sizeof(chunk);
+        size_t got = fread(chunk, 1, want, c->in);
+        if (got == 0)
+            return -1;
+        if (sink)
+            fwrite(chunk, 1, got, sink);
+        n -= (long)got;
+    }
+    return 1;
+}
+
+/* stdin is sent as an in-memory buffer */
+static int send_stdin(struct Conn *c)
+{
+    size_t cap = 65536, len = 0;
+    char *buf = malloc(cap);
+    size_t got;
+    while (buf && (got = fread(buf + len, 1, cap - len, stdin)) > 0)
+    {
+        len += got;
+        if (len == cap)
+        {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown)
+            {
+                free(buf);
+                return 0;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if (!buf)
+        return 0;
+    fprintf(c->out, "%s %s BUF %zu <stdin>\n", lang_s, fmt_s, len);
+    fwrite(buf, 1, len, c->out);
+    free(buf);
+    return 1;
+}
+
+static int run_batch(char **files, int nfiles)
+{
+    struct Conn c;
+    if (!conn_open(&c))
+    {
+        perror(sock_path);
+        return 1;
+    }
+    int status = 0, pending = 0;
+    for (int i = 0; i <= nfiles; i++)
+    {
+        int is_stdin = i < nfiles && strcmp(files[i], "-") == 0;
+        /* drain replies at the end, when the window is full, or before a large buffer */
+        if (i == nfiles || pending == BATCH || is_stdin)
+        {
+            fflush(c.out);
+            for (; pending > 0; pending--)
+            {
+                int r = read_reply(&c, stdout);
+                if (r < 0)
+                {
+                    fprintf(stderr, "connection to server lost\n");
+                    conn_drop(&c);
+                    return 1;
+                }
+                if (r == 0)
+                    status = 1;
+            }
+        }
+        if (i == nfiles)
+            break;
+        if (is_stdin)
+        {
+            if (!send_stdin(&c))
+            {
+                conn_drop(&c);
+                return 1;
+            }
+        }
+        else
+            send_path(&c, files[i]);
+        pending++;
+    }
+    conn_close(&c);
+    return status;
+}
+
+/* ---------- load test ---------- */
+struct LoadArgs
+{
+    char **files;
+    int nfiles;
+    int first, count; /* slice of the latency array owned by this client */
+    double *lat_ms;   /* -1: no reply */
+    int failures;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void *load_client(void *arg)
+{
+    struct LoadArgs *a = arg;
+    struct Conn c;
+    if (!conn_open(&c))
+    {
+        a->failures = a->count;
+        return NULL;
+    }
+    for (int i = 0; i < a->count; i++)
+    {
+        int k = a->first + i;
+        double t0 = now_ms();
+        send_path(&c, a->files[k % a->nfiles]);
+        fflush(c.out);
+        int r = read_reply(&c, NULL);
+        if (r < 0)
+        {
+            a->failures += a->count - i;
+            conn_drop(&c);
+            return NULL;
+        }
+        a->lat_ms[k] = now_ms() - t0;
+        if (r == 0)
+            a->failures++;
+    }
+    conn_close(&c);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+    int k = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[k];
+}
+
+static int run_load(char **files, int nfiles, int clients, int total)
+{
+    double *lat = malloc((size_t)total * sizeof(double));
+    struct LoadArgs *args = calloc((size_t)clients, sizeof(*args));
+    pthread_t *tids = calloc((size_t)clients, sizeof(*tids));
+    char *started = calloc((size_t)clients, 1);
+    if (!lat || !args || !tids || !started)
+        return 1;
+    for (int i = 0; i < total; i++)
+        lat[i] = -1;
+
+    double t0 = now_ms();
+    int first = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        args[i].files = files;
+        args[i].nfiles = nfiles;
+        args[i].first = first;
+        args[i].count = total / clients + (i < total % clients);
+        args[i].lat_ms = lat;
+        first += args[i].count;
+        if (pthread_create(&tids[i], NULL, load_client, &args[i]) == 0)
+            started[i] = 1;
+        else
+            args[i].failures = args[i].count;
+    }
+    int failures = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        failures += args[i].failures;
+    }
+    double wall = now_ms() - t0;
+
+    /* percentiles over the requests that got a reply */
+    int done = 0;
+    for (int i = 0; i < total; i++)
+        if (lat[i] >= 0)
+            lat[done++] = lat[i];
+    qsort(lat, (size_t)done, sizeof(double), cmp_double);
+    printf("requests=%d completed=%d clients=%d failures=%d wall=%.1fms throughput=%.0f req/s\n",
+           total, done, clients, failures, wall, done / (wall / 1e3));
+    if (done)
+        printf("latency ms: p50=%.3f p90=%.3f p99=%.3f p99.9=%.3f max=%.3f\n",
+               percentile(lat, done, 50), percentile(lat, done, 90), percentile(lat, done, 99),
+               percentile(lat, done, 99.9), lat[done - 1]);
+    free(lat);
+    free(args);
+    free(tids);
+    free(started);
+    return failures ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-s SOCKET] [--format box|tsv|summary|docs] [--lang java|kotlin|auto] FILE...\n"
+            "       %s [-s SOCKET] --load [-c CLIENTS] [-n REQUESTS] [--format F] FILE...\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    int load = 0, clients = 8, total = 10000;
+    sock_path = getenv("LEXER_SOCKET") ? getenv("LEXER_SOCKET") : "/tmp/lexer.sock";
+    signal(SIGPIPE, SIG_IGN); /* a server that goes away is reported, not fatal */
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            sock_path = argv[++i];
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            fmt_s = argv[++i];
+        else if (strcmp(argv[i], "--lang") == 0 && i + 1 < argc)
+            lang_s = argv[++i];
+        else if (strcmp(argv[i], "--load") == 0)
+            load = 1;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            clients = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            total = atoi(argv[++i]);
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (i == argc || clients < 1 || total < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (load)
+        return run_load(argv + i, argc - i, clients, total);
+    return run_batch(argv + i, argc - i);
+}
@@ -1,107 +1,419 @@
-/* File: lexer_interactive_colored.c
+/* File: lexical_analyzer3.c
    Interactive Java/Kotlin lexical analyzer with pastel colors + minimal animation.
 
    Compile:
-     gcc lexer_interactive_colored.c -o lexer -O2
+     gcc lexical_analyzer3.c -o lexer -O2 -pthread -lz -ldl
+     gcc lexer_client.c -o lexer_client -O2 -pthread
 
    Run:
-     ./lexer
+     ./lexer                                        (interactive)
+     ./lexer [--format box|tsv|summary|docs] FILE... (one-shot, no prompts)
+     ./lexer --serve SOCKET [--workers N]           (persistent analysis server, see lexer_client.c)
+     ./lexer --bench N FILE...                      (throughput per file and language)
+     ./lexer --stress MB                            (linear time/memory on adversarial inputs)
+     ./lexer --index INDEX PATH...                  (project-wide declaration index; updates PATH... if INDEX exists)
+     ./lexer --project INDEX [--format F] FILE...   (resolve imports / sibling files via INDEX)
+     ./lexer --pipeline [--depth N] PATH...         (threaded read/lex/analyze/write stages + stall report)
+     ./lexer --diff [--bench N] OLD NEW             (token-level changes, ignoring layout and comments)
+     ./lexer --clones [--kgram K] [--winnow W] PATH... (copy-pasted code, identifiers/literals normalized)
+     ./lexer --find "KIND:text ..." PATH...         (token-aware grep: no hits in comments or strings)
+     ./lexer --highlight ansi|html FILE...          (source with token/comment colors, layout kept)
+     ./lexer --archive [--bench N] ARCHIVE...        (.jar/.zip/.tar[.gz|.zst] sources lexed in memory)
+   --no-comments skips comments without storing them; --format docs lists the
+   declaration -> doc comment index (so it is refused with --no-comments).
 */
 
+#define _GNU_SOURCE /* memmem */
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h> /* usleep */
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_TOKENS 16000
-#define MAX_COMMENTS 6000
-#define MAX_ERRORS 6000
+#define TOK_INIT 4096 /* token table grows by doubling */
+#define MAX_ERRORS 6000 /* reported per file */
 #define MAX_DECLS 6000
 
 /* Data structures */
 struct Symbol
 {
-    char token[512];
+    const char *token; /* NUL-terminated copy in the thread's text pool */
     int attribute;
     int line;
+    unsigned int off, len; /* span in the analyzed source (highlighting) */
 };
 struct Decl
 {
-    char name[256];
-    char type[128];
+    const char *name; /* interned */
+    const char *type;
     int line;
+    int doc;   /* index of its doc comment in comments[], or -1 */
+    int depth; /* brace nesting where declared: 0 = top level */
 };
 struct Error
 {
-    char msg[512];
+    const char *msg; /* copy in the arena */
     int line;
 };
+/* a comment is a span into the source buffer (not NUL-terminated) */
+struct Comment
+{
+    const char *text;
+    int len;
+    int line, end_line;
+    int next_tok; /* doc comments: index of the first token after it; otherwise -1 */
+};
+
+/* Analysis state is per thread; the tables are arrays in the thread's arena
+   (below) that double on demand and are dropped wholesale for the next file. */
+static __thread struct Symbol *table;
+static __thread struct Decl *decls;
+static __thread struct Error *errors;
+static __thread struct Comment *comments;
+
+static __thread int tok_count = 0, decl_count = 0, err_count = 0, com_count = 0;
+static __thread int tok_cap = 0, decl_cap = 0, err_cap = 0, com_cap = 0;
+
+/* declarations by name (decl index + 1, 0 = empty): lookups stay O(1) however many there are */
+static __thread int *decl_slots;
+static __thread uint32_t decl_mask;
+
+/* Everything recorded for a file (token records and texts, declarations,
+   comments, diagnostics) is carved out of one arena per thread. Resetting it
+   for the next file is O(1); if a file spilled past the first chunk, the chain
+   is replaced by one chunk of the new high-water size, so once a thread has
+   seen its largest file, analysis does no malloc/free at all. */
+#define ARENA_CHUNK 65536
+struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t cap;
+    char data[]; /* 16-byte aligned after the header */
+};
+struct Arena
+{
+    struct ArenaChunk *head, *cur;
+    size_t used;  /* bytes taken in cur */
+    size_t taken; /* bytes taken for the current file, across chunks */
+    size_t high;  /* largest taken so far */
+};
+static __thread struct Arena arena;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* counts the arena's chunk allocations only (reported by --bench); the source
+   buffer, stdio and the scratch buffers of diff / clones / find are not counted */
+static long arena_mallocs, arena_frees, arena_nsecs;
+
+static struct ArenaChunk *arena_chunk_new(size_t cap)
+{
+    double t0 = now_sec();
+    struct ArenaChunk *c = malloc(sizeof(*c) + cap);
+    if (c)
+    {
+        c->next = NULL;
+        c->cap = cap;
+        __atomic_fetch_add(&arena_mallocs, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&arena_nsecs, (long)((now_sec() - t0) * 1e9), __ATOMIC_RELAXED);
+    return c;
+}
+
+static void arena_chain_free(struct ArenaChunk *c)
+{
+    double t0 = now_sec();
+    for (struct ArenaChunk *next; c; c = next)
+    {
+        next = c->next;
+        free(c);
+        __atomic_fetch_add(&arena_frees, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&arena_nsecs, (long)((now_sec() - t0) * 1e9), __ATOMIC_RELAXED);
+}
+
+static void *arena_alloc(size_t n)
+{
+    n = (n + 7) & ~(size_t)7;
+    while (!arena.cur || arena.used + n > arena.cur->cap)
+    {
+        if (arena.cur && arena.cur->next)
+        {
+            arena.cur = arena.cur->next;
+            arena.used = 0;
+            continue;
+        }
+        struct ArenaChunk *c = arena_chunk_new(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+        if (!c)
+            return NULL;
+        if (arena.cur)
+            arena.cur->next = c;
+        else
+            arena.head = c;
+        arena.cur = c;
+        arena.used = 0;
+    }
+    void *p = arena.cur->data + arena.used;
+    arena.used += n;
+    arena.taken += n;
+    return p;
+}
+
+/* grow an arena array to hold one more element; the old block stays behind until the reset */
+static void *arena_grow(void *old, int *cap, size_t elem, int init)
+{
+    int ncap = *cap ? *cap * 2 : init;
+    void *p = arena_alloc((size_t)ncap * elem);
+    if (!p)
+        return NULL;
+    if (old)
+        memcpy(p, old, (size_t)*cap * elem);
+    *cap = ncap;
+    return p;
+}
+
+static void arena_reset(void)
+{
+    if (arena.taken > arena.high)
+        arena.high = arena.taken;
+    if (arena.head && arena.head->next)
+    {
+        size_t cap = (arena.high + ARENA_CHUNK - 1) / ARENA_CHUNK * ARENA_CHUNK;
+        arena_chain_free(arena.head);
+        arena.head = arena_chunk_new(cap); /* NULL: the next alloc starts a new chain */
+    }
+    arena.cur = arena.head;
+    arena.used = arena.taken = 0;
+}
+
+static void arena_free(struct Arena *a)
+{
+    arena_chain_free(a->head);
+    memset(a, 0, sizeof(*a));
+}
+
+static uint32_t hash_str(const char *s)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+static uint32_t hash_mem(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+/* Token texts are interned per file: each distinct spelling is stored once. */
+struct InternSlot
+{
+    const char *text; /* NULL: empty slot */
+    uint32_t hash, len;
+};
+struct InternSet
+{
+    struct InternSlot *slots;
+    uint32_t mask, count;
+};
+static __thread struct InternSet interned;
+
+/* one-character tokens (most separators and operators) need no copy at all */
+#define ONE_CHAR1(c) (char)(c), 0
+#define ONE_CHAR4(c) ONE_CHAR1(c), ONE_CHAR1(c + 1), ONE_CHAR1(c + 2), ONE_CHAR1(c + 3)
+#define ONE_CHAR16(c) ONE_CHAR4(c), ONE_CHAR4(c + 4), ONE_CHAR4(c + 8), ONE_CHAR4(c + 12)
+#define ONE_CHAR64(c) ONE_CHAR16(c), ONE_CHAR16(c + 16), ONE_CHAR16(c + 32), ONE_CHAR16(c + 48)
+static const char one_char[512] = {ONE_CHAR64(0), ONE_CHAR64(64), ONE_CHAR64(128), ONE_CHAR64(192)};
+
+static const char *intern(const char *s, size_t n)
+{
+    if (n == 1)
+        return &one_char[2 * (unsigned char)s[0]];
+    if (interned.count >= interned.mask / 4 * 3) /* linear probing up to 3/4 full */
+    {
+        uint32_t cap = interned.slots ? (interned.mask + 1) * 2 : 64;
+        struct InternSlot *slots = arena_alloc(cap * sizeof(*slots));
+        if (!slots)
+            return NULL;
+        memset(slots, 0, cap * sizeof(*slots));
+        for (uint32_t i = 0; interned.slots && i <= interned.mask; i++)
+        {
+            if (!interned.slots[i].text)
+                continue;
+            uint32_t k = interned.slots[i].hash & (cap - 1);
+            while (slots[k].text)
+                k = (k + 1) & (cap - 1);
+            slots[k] = interned.slots[i];
+        }
+        interned.slots = slots;
+        interned.mask = cap - 1;
+    }
+    uint32_t h = hash_mem(s, n);
+    uint32_t k = h & interned.mask;
+    for (; interned.slots[k].text; k = (k + 1) & interned.mask)
+    {
+        const struct InternSlot *e = &interned.slots[k];
+        if (e->hash == h && e->len == n && memcmp(e->text, s, n) == 0)
+            return e->text;
+    }
+    char *copy = arena_alloc(n + 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, s, n);
+    copy[n] = 0;
+    interned.slots[k] = (struct InternSlot){copy, h, (uint32_t)n};
+    interned.count++;
+    return copy;
+}
+
+/* comments are kept by default; --no-comments skips them without storing anything */
+static int keep_comments = 1;
+
+/* start a new file: every table is empty and lives in the arena again */
+static void reset_tables(void)
+{
+    arena_reset();
+    memset(&interned, 0, sizeof(interned));
+    decl_slots = NULL;
+    decl_mask = 0;
+    table = NULL;
+    decls = NULL;
+    errors = NULL;
+    comments = NULL;
+    tok_count = decl_count = err_count = com_count = 0;
+    tok_cap = decl_cap = err_cap = com_cap = 0;
+}
 
-static struct Symbol table[MAX_TOKENS];
-static struct Decl decls[MAX_DECLS];
-static struct Error errors[MAX_ERRORS];
-static char comments[MAX_COMMENTS][1024];
+/* Languages and output formats (selected per file / per request) */
+enum
+{
+    LANG_AUTO,
+    LANG_JAVA,
+    LANG_KOTLIN
+};
+enum
+{
+    FMT_BOX,
+    FMT_TSV,
+    FMT_SUMMARY,
+    FMT_DOCS
+};
 
-static int tok_count = 0, decl_count = 0, err_count = 0, com_count = 0;
+/* header lines are drawn with a small animation only in interactive mode */
+static int animate = 0;
 
-/* Combined Java + Kotlin keywords & types */
-static const char *keywords[] = {
+/* Per-language keywords & types */
+static const char *java_keywords[] = {
     "int", "float", "double", "char", "if", "else", "for", "while", "class",
-    "public", "private", "return", "static", "void", "new",
+    "public", "private", "return", "static", "void", "new", "var",
+    "null", "true", "false", "package", "import", "String"};
+static const char *kotlin_keywords[] = {
+    "if", "else", "for", "while", "class", "public", "private", "return",
     "fun", "var", "val", "when", "is", "in", "object", "null", "true", "false",
     "package", "import", "override", "data", "sealed", "lateinit",
     "Int", "Float", "Double", "Char", "String", "Boolean", "Long", "Short", "Byte"};
-static int keyword_count = sizeof(keywords) / sizeof(keywords[0]);
+#define JAVA_KEYWORD_COUNT (int)(sizeof(java_keywords) / sizeof(java_keywords[0]))
+#define KOTLIN_KEYWORD_COUNT (int)(sizeof(kotlin_keywords) / sizeof(kotlin_keywords[0]))
+
+/* The lexer and pass 2 are written once as always-inline bodies taking the
+   language as a constant, then instantiated per language (tokenize_java,
+   tokenize_kotlin, ...): every `lang ==` test folds away at compile time. */
+#define LANG_SPECIALIZED static inline __attribute__((always_inline))
 
 /* Utilities */
 static int min_int(int a, int b) { return a < b ? a : b; }
-static int levenshtein(const char *a, const char *b)
+/* edit distance, or limit + 1 as soon as it must exceed limit */
+static int levenshtein(const char *a, const char *b, int limit)
 {
     int n = (int)strlen(a), m = (int)strlen(b);
-    if (n > 300 || m > 300)
-        return abs(n - m) + 3;
-    static int dp[601][601];
-    for (int i = 0; i <= n; i++)
-        dp[i][0] = i;
+    if (n > 300 || m > 300 || abs(n - m) > limit)
+        return limit + 1;
+    /* two rolling rows on the stack: thread-safe, no shared scratch table */
+    int rows[2][301];
+    int *prev = rows[0], *cur = rows[1];
     for (int j = 0; j <= m; j++)
-        dp[0][j] = j;
+        prev[j] = j;
     for (int i = 1; i <= n; i++)
+    {
+        cur[0] = i;
+        int row_min = i;
         for (int j = 1; j <= m; j++)
-            dp[i][j] = (a[i - 1] == b[j - 1]) ? dp[i - 1][j - 1] : 1 + min_int(dp[i - 1][j - 1], min_int(dp[i - 1][j], dp[i][j - 1]));
-    return dp[n][m];
+        {
+            cur[j] = (a[i - 1] == b[j - 1]) ? prev[j - 1] : 1 + min_int(prev[j - 1], min_int(prev[j], cur[j - 1]));
+            row_min = min_int(row_min, cur[j]);
+        }
+        if (row_min > limit) /* rows never decrease below their minimum */
+            return limit + 1;
+        int *t = prev;
+        prev = cur;
+        cur = t;
+    }
+    return prev[m] > limit ? limit + 1 : prev[m];
 }
-static int isKeyword(const char *w)
+LANG_SPECIALIZED int isKeyword(const char *w, const int lang)
 {
-    for (int i = 0; i < keyword_count; i++)
-        if (strcmp(w, keywords[i]) == 0)
+    const char **kw = lang == LANG_KOTLIN ? kotlin_keywords : java_keywords;
+    int n = lang == LANG_KOTLIN ? KOTLIN_KEYWORD_COUNT : JAVA_KEYWORD_COUNT;
+    for (int i = 0; i < n; i++)
+        if (strcmp(w, kw[i]) == 0)
             return 1;
     return 0;
 }
-static int similarToKeyword(const char *w)
+LANG_SPECIALIZED int similarToKeyword(const char *w, const int lang)
 {
     int L = (int)strlen(w);
     if (L < 3)
         return 0;
-    for (int i = 0; i < keyword_count; i++)
-        if (levenshtein(w, keywords[i]) <= 2)
+    const char **kw = lang == LANG_KOTLIN ? kotlin_keywords : java_keywords;
+    int n = lang == LANG_KOTLIN ? KOTLIN_KEYWORD_COUNT : JAVA_KEYWORD_COUNT;
+    for (int i = 0; i < n; i++)
+        if (levenshtein(w, kw[i], 2) <= 2)
             return 1;
     return 0;
 }
+/* slot of name in decl_slots: its declaration, or the empty slot it would take */
+static int *decl_slot(const char *name)
+{
+    uint32_t k = hash_str(name) & decl_mask;
+    for (; decl_slots[k]; k = (k + 1) & decl_mask)
+    {
+        const char *d = decls[decl_slots[k] - 1].name;
+        if (d == name || strcmp(d, name) == 0) /* interned names mostly compare by pointer */
+            break;
+    }
+    return &decl_slots[k];
+}
 static int isDeclared(const char *id)
 {
-    for (int i = 0; i < decl_count; i++)
-        if (strcmp(id, decls[i].name) == 0)
-            return 1;
-    return 0;
+    return decl_slots && *decl_slot(id) != 0;
 }
 static const char *getType(const char *id)
 {
-    for (int i = 0; i < decl_count; i++)
-        if (strcmp(id, decls[i].name) == 0)
-            return decls[i].type;
-    return "UNKNOWN";
+    int *slot = decl_slots ? decl_slot(id) : NULL;
+    return slot && *slot ? decls[*slot - 1].type : "UNKNOWN";
 }
 static int isRelOp(const char *t)
 {
@@ -202,20 +514,53 @@ static const char *attrColor(int a)
     }
 }
 
+/* source being lexed: the whole file in memory, so comments can point into it */
+struct Src
+{
+    const char *p;
+    size_t len, pos;
+};
+
 /* robust getc/ungetc with newline accounting */
-static int getc_nl(FILE *fp, int *line)
+static int getc_nl(struct Src *src, int *line)
 {
-    int c = fgetc(fp);
-    if (c == '\r')
-        return getc_nl(fp, line);
-    if (c == '\n')
+    int c;
+    do /* a loop, not recursion: a run of \r must not grow the stack */
     {
+        if (src->pos >= src->len)
+            return EOF;
+        c = (unsigned char)src->p[src->pos++];
+    } while (c == '\r');
+    if (c == '\n')
         (*line)++;
-        return c;
-    }
     return c;
 }
-static void ungetc_nl(int c, FILE *fp, int *line)
+/* end of the token just read: the read position, less a skipped \r */
+static size_t tok_span_end(const struct Src *src)
+{
+    size_t end = src->pos;
+    while (end > 0 && src->p[end - 1] == '\r')
+        end--;
+    return end;
+}
+/* text of the source span [start, end) as the lexer read it (without \r),
+   interned straight from the source: no fixed buffer, no length limit */
+static const char *span_text(const struct Src *src, size_t start, size_t end)
+{
+    const char *p = src->p + start;
+    size_t n = end - start;
+    if (!memchr(p, '\r', n))
+        return intern(p, n);
+    char *tmp = arena_alloc(n); /* rare: left behind until the next file */
+    if (!tmp)
+        return NULL;
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++)
+        if (p[i] != '\r')
+            tmp[k++] = p[i];
+    return intern(tmp, k);
+}
+static void ungetc_nl(int c, struct Src *src, int *line)
 {
     if (c == EOF)
         return;
@@ -226,20 +571,223 @@ static void ungetc_nl(int c, FILE *fp, int *line)
         if (*line > 1)
             (*line)--;
     }
-    ungetc(c, fp);
+    src->pos--; /* c is always the character just read */
+}
+
+/* ---------- What the lexer does not read as code ----------
+   Comments, string and char literals and package/import names, in one
+   place: tokenize_impl and the --find state scan both use these, so the
+   scan skips exactly what the lexer skips. */
+
+enum
+{
+    SPAN_CODE,
+    SPAN_LINE_COMMENT,
+    SPAN_BLOCK_COMMENT,
+    SPAN_STRING,
+    SPAN_CHAR
+};
+struct Span
+{
+    int kind;
+    size_t end; /* comments: end of the comment text (no newline, no \r) */
+    char chr[4]; /* char literal: its token text */
+    int chr_len;
+};
+
+/* c was just read where a lexeme starts. If it opens a comment, a string or
+   a char literal, read the whole of it and return its kind; otherwise
+   return SPAN_CODE with src left as it was. */
+static int lex_span(struct Src *src, int c, int *line, struct Span *sp)
+{
+    const char *p = src->p;
+    size_t start = src->pos - 1;
+    sp->kind = SPAN_CODE;
+    if (c == '/')
+    {
+        int nxt = getc_nl(src, line);
+        if (nxt == '/')
+        {
+            const char *nl = memchr(p + src->pos, '\n', src->len - src->pos);
+            size_t end = nl ? (size_t)(nl - p) : src->len;
+            src->pos = nl ? end + 1 : end;
+            if (nl)
+                (*line)++;
+            sp->end = end;
+            sp->kind = SPAN_LINE_COMMENT;
+        }
+        else if (nxt == '*')
+        {
+            /* ends at the first slash read right after a star (a \r between
+               them is skipped like anywhere else) */
+            size_t body = src->pos, end = src->len;
+            for (const char *q = p + body; (q = memchr(q, '/', src->len - (size_t)(q - p))); q++)
+            {
+                size_t k = (size_t)(q - p);
+                while (k > body && p[k - 1] == '\r')
+                    k--;
+                if (k > body && p[k - 1] == '*')
+                {
+                    end = (size_t)(q - p) + 1;
+                    break;
+                }
+            }
+            for (const char *q = p + body; (q = memchr(q, '\n', end - (size_t)(q - p))); q++)
+                (*line)++;
+            src->pos = sp->end = end;
+            sp->kind = SPAN_BLOCK_COMMENT;
+        }
+        else
+            ungetc_nl(nxt, src, line);
+        if (sp->kind == SPAN_LINE_COMMENT)
+            while (sp->end > start && p[sp->end - 1] == '\r')
+                sp->end--;
+    }
+    else if (c == '"')
+    {
+        int c2;
+        while ((c2 = getc_nl(src, line)) != EOF && c2 != '"')
+            if (c2 == '\\')
+                getc_nl(src, line); /* escaped character, possibly a quote */
+        sp->kind = SPAN_STRING;
+    }
+    else if (c == '\'')
+    {
+        /* quote, one char (two if escaped), then one more char that is kept
+           only when it is the closing quote */
+        int idx = 0;
+        sp->chr[idx++] = '\'';
+        int c2 = getc_nl(src, line);
+        if (c2 == '\\')
+        {
+            sp->chr[idx++] = '\\';
+            int c3 = getc_nl(src, line);
+            if (c3 != EOF)
+                sp->chr[idx++] = (char)c3;
+        }
+        else if (c2 != EOF)
+            sp->chr[idx++] = (char)c2;
+        if (getc_nl(src, line) == '\'')
+            sp->chr[idx++] = '\'';
+        sp->chr_len = idx;
+        sp->kind = SPAN_CHAR;
+    }
+    return sp->kind;
+}
+
+/* identifier characters after the first one */
+static void lex_word(struct Src *src, int *line)
+{
+    int c2;
+    while ((c2 = getc_nl(src, line)) != EOF && (isalnum(c2) || c2 == '_'))
+        ;
+    if (c2 != EOF)
+        ungetc_nl(c2, src, line);
+}
+
+/* package and import take the rest of their line as one NAMESPACE token */
+static int is_namespace_kw(const char *word, int lang)
+{
+    return (strcmp(word, "package") == 0 || strcmp(word, "import") == 0) && isKeyword(word, lang);
+}
+
+/* after package / import: the name runs to ; or the end of the line (both
+   read too), trailing blanks trimmed. Returns 0, with the newline left
+   unread, when the line holds no name. */
+static int lex_namespace(struct Src *src, int *line, size_t *start, size_t *end)
+{
+    int pch;
+    while ((pch = getc_nl(src, line)) != EOF && isspace(pch) && pch != '\n')
+        ;
+    if (pch == '\n' || pch == EOF)
+    {
+        if (pch != EOF)
+            ungetc_nl(pch, src, line);
+        return 0;
+    }
+    size_t ns_start = src->pos - 1;
+    while (pch != EOF && pch != '\n' && pch != ';')
+        pch = getc_nl(src, line);
+    size_t ns_end = pch == EOF ? src->pos : src->pos - 1;
+    while (ns_end > ns_start && isspace((unsigned char)src->p[ns_end - 1]))
+        ns_end--;
+    *start = ns_start;
+    *end = ns_end;
+    return 1;
 }
 
-/* helper to record declaration */
-static void add_decl(const char *name, const char *type, int line)
+/* helper to record declaration (doc: attached doc comment or -1); name and
+   type are kept as given: interned token texts or string literals */
+static void add_decl(const char *name, const char *type, int line, int doc, int depth)
 {
     if (decl_count >= MAX_DECLS)
         return;
     if (isDeclared(name))
         return;
-    strncpy(decls[decl_count].name, name, sizeof(decls[decl_count].name) - 1);
-    strncpy(decls[decl_count].type, type, sizeof(decls[decl_count].type) - 1);
+    if (decl_count == decl_cap)
+    {
+        struct Decl *grown = arena_grow(decls, &decl_cap, sizeof(*decls), 64);
+        if (!grown)
+            return;
+        decls = grown;
+    }
+    if ((uint32_t)decl_count * 2 >= decl_mask)
+    {
+        uint32_t cap = decl_slots ? (decl_mask + 1) * 2 : 128;
+        int *slots = arena_alloc(cap * sizeof(*slots));
+        if (!slots)
+            return;
+        memset(slots, 0, cap * sizeof(*slots));
+        decl_slots = slots;
+        decl_mask = cap - 1;
+        for (int i = 0; i < decl_count; i++)
+            *decl_slot(decls[i].name) = i + 1;
+    }
+    decls[decl_count].name = name;
+    decls[decl_count].type = type;
     decls[decl_count].line = line;
+    decls[decl_count].doc = doc;
+    decls[decl_count].depth = depth;
     decl_count++;
+    *decl_slot(name) = decl_count;
+}
+
+/* helper to record an interned token text; [start, end) is its span in the source */
+static void add_token(const char *tok, int attribute, int line, size_t start, size_t end)
+{
+    if (!tok)
+        return;
+    if (tok_count == tok_cap)
+    {
+        struct Symbol *grown = arena_grow(table, &tok_cap, sizeof(*table), TOK_INIT);
+        if (!grown)
+            return;
+        table = grown;
+    }
+    table[tok_count].token = tok;
+    table[tok_count].attribute = attribute;
+    table[tok_count].line = line;
+    table[tok_count].off = (unsigned int)start;
+    table[tok_count].len = (unsigned int)(end - start);
+    tok_count++;
+}
+
+/* helper to record comment span; returns its index or -1 */
+static int add_comment(const char *text, int len, int line, int end_line)
+{
+    if (com_count == com_cap)
+    {
+        struct Comment *grown = arena_grow(comments, &com_cap, sizeof(*comments), 256);
+        if (!grown)
+            return -1;
+        comments = grown;
+    }
+    comments[com_count].text = text;
+    comments[com_count].len = len;
+    comments[com_count].line = line;
+    comments[com_count].end_line = end_line;
+    comments[com_count].next_tok = -1;
+    return com_count++;
 }
 
 /* report error */
@@ -247,7 +795,19 @@ static void report_error(const char *msg, int line)
 {
     if (err_count >= MAX_ERRORS)
         return;
-    strncpy(errors[err_count].msg, msg, sizeof(errors[err_count].msg) - 1);
+    if (err_count == err_cap)
+    {
+        struct Error *grown = arena_grow(errors, &err_cap, sizeof(*errors), 64);
+        if (!grown)
+            return;
+        errors = grown;
+    }
+    size_t n = strlen(msg) + 1;
+    char *copy = arena_alloc(n);
+    if (!copy)
+        return;
+    memcpy(copy, msg, n);
+    errors[err_count].msg = copy;
     errors[err_count].line = line;
     err_count++;
 }
@@ -315,132 +875,90 @@ static void check_assignment_type(const char *decl_type, const char *value_token
     }
 }
 
-/* PASS 1: tokenize & initial decls (kept robust) */
-int tokenize_and_build(const char *filename)
+/* language of the file currently held in the tables (decides the pass 2 instance) */
+static __thread int cur_lang = LANG_JAVA;
+
+/* PASS 1: tokenize & initial decls (kept robust) over a source held in memory.
+   text must stay valid while the results are used: comments point into it. */
+LANG_SPECIALIZED int tokenize_impl(const char *text, size_t len, const int lang)
 {
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        return 0;
-    tok_count = decl_count = err_count = com_count = 0;
+    reset_tables();
+    /* sources rarely average under 4 bytes per token: size the table once
+       instead of leaving doubled copies behind in the arena */
+    size_t guess = len / 4 < (1u << 28) ? len / 4 : (1u << 28);
+    table = arena_grow(NULL, &tok_cap, sizeof(*table), guess > TOK_INIT ? (int)guess : TOK_INIT);
+    cur_lang = lang;
+    struct Src source = {text, len, 0};
+    struct Src *src = &source;
     int line = 1;
     int ch;
-    while ((ch = getc_nl(fp, &line)) != EOF)
+    /* last doc comment not yet followed by a declaration or a ; { } separator */
+    int pending_doc = -1;
+    int depth = 0; /* brace nesting */
+    while ((ch = getc_nl(src, &line)) != EOF)
     {
         if (ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f')
             continue;
+        size_t tok_start = src->pos - 1;
 
-        /* comments */
-        if (ch == '/')
+        /* comments, strings and char literals */
+        int start_line = line;
+        struct Span sp;
+        switch (lex_span(src, ch, &line, &sp))
         {
-            int nxt = getc_nl(fp, &line);
-            if (nxt == '/')
-            {
-                char buf[1024];
-                int idx = 0;
-                buf[idx++] = '/';
-                buf[idx++] = '/';
-                int c2;
-                while ((c2 = getc_nl(fp, &line)) != EOF && c2 != '\n')
-                {
-                    if (idx < (int)sizeof(buf) - 1)
-                        buf[idx++] = (char)c2;
-                }
-                buf[idx] = 0;
-                if (com_count < MAX_COMMENTS)
-                    strcpy(comments[com_count++], buf);
-                continue;
-            }
-            else if (nxt == '*')
+        case SPAN_LINE_COMMENT:
+            if (keep_comments)
+                add_comment(text + tok_start, (int)(sp.end - tok_start), start_line, start_line);
+            continue;
+        case SPAN_BLOCK_COMMENT:
+            if (keep_comments)
             {
-                char buf[1024];
-                int idx = 0;
-                buf[idx++] = '/';
-                buf[idx++] = '*';
-                int prev = 0, c2;
-                while ((c2 = getc_nl(fp, &line)) != EOF)
+                int clen = (int)(sp.end - tok_start);
+                int idx = add_comment(text + tok_start, clen, start_line, line);
+                /* doc comment: starts with slash-star-star and is not just an empty block */
+                if (idx >= 0 && clen > 4 && text[tok_start + 2] == '*')
                 {
-                    if (idx < (int)sizeof(buf) - 1)
-                        buf[idx++] = (char)c2;
-                    if (prev == '*' && c2 == '/')
-                        break;
-                    prev = c2;
+                    pending_doc = idx;
+                    comments[idx].next_tok = tok_count;
                 }
-                buf[idx] = 0;
-                if (com_count < MAX_COMMENTS)
-                    strcpy(comments[com_count++], buf);
-                continue;
-            }
-            else
-            {
-                ungetc_nl(nxt, fp, &line);
             }
+            continue;
+        case SPAN_STRING:
+        {
+            size_t tok_end = tok_span_end(src);
+            add_token(span_text(src, tok_start, tok_end), 6, line, tok_start, tok_end);
+            continue;
+        }
+        case SPAN_CHAR:
+            add_token(intern(sp.chr, (size_t)sp.chr_len), 7, line, tok_start, tok_span_end(src));
+            continue;
         }
 
         /* identifier / keyword */
         if (isalpha(ch) || ch == '_')
         {
-            char buf[512];
-            int idx = 0;
-            buf[idx++] = (char)ch;
-            int c2;
-            while ((c2 = getc_nl(fp, &line)) != EOF && (isalnum(c2) || c2 == '_'))
-            {
-                if (idx < (int)sizeof(buf) - 1)
-                    buf[idx++] = (char)c2;
-            }
-            if (c2 != EOF)
-                ungetc_nl(c2, fp, &line);
-            buf[idx] = 0;
-            strcpy(table[tok_count].token, buf);
-            table[tok_count].attribute = isKeyword(buf) ? 1 : 2;
-            table[tok_count].line = line;
-            tok_count++;
+            lex_word(src, &line);
+            size_t tok_end = tok_span_end(src);
+            const char *word = span_text(src, tok_start, tok_end);
+            if (!word)
+                continue;
+            int is_kw = isKeyword(word, lang);
+            add_token(word, is_kw ? 1 : 2, line, tok_start, tok_end);
 
             /* package/import namespace capture */
-            if (isKeyword(buf) && (strcmp(buf, "package") == 0 || strcmp(buf, "import") == 0))
+            if (is_namespace_kw(word, lang))
             {
-                int pch;
-                while ((pch = getc_nl(fp, &line)) != EOF && isspace(pch) && pch != '\n')
-                    ;
-                if (pch == '\n' || pch == EOF)
-                {
-                    if (pch != EOF)
-                        ungetc_nl(pch, fp, &line);
-                    continue;
-                }
-                char nb[512];
-                int nidx = 0;
-                while (pch != EOF && pch != '\n' && pch != ';')
-                {
-                    if (nidx < (int)sizeof(nb) - 1)
-                        nb[nidx++] = (char)pch;
-                    pch = getc_nl(fp, &line);
-                }
-                nb[nidx] = 0;
-                int s = 0, e = nidx - 1;
-                while (s <= e && isspace((unsigned char)nb[s]))
-                    s++;
-                while (e >= s && isspace((unsigned char)nb[e]))
-                    e--;
-                char final[512];
-                int fidx = 0;
-                for (int k = s; k <= e; k++)
-                    final[fidx++] = nb[k];
-                final[fidx] = 0;
-                if (fidx > 0)
-                {
-                    strcpy(table[tok_count].token, final);
-                    table[tok_count].attribute = 8;
-                    table[tok_count].line = line;
-                    tok_count++;
-                }
+                size_t ns_start, ns_end;
+                if (lex_namespace(src, &line, &ns_start, &ns_end) && ns_end > ns_start)
+                    add_token(span_text(src, ns_start, ns_end), 8, line, ns_start, ns_end);
                 continue;
             }
 
-            /* immediate Java-style declaration detection */
-            if (tok_count >= 2 && table[tok_count - 2].attribute == 1 && table[tok_count - 1].attribute == 2)
+            /* immediate Java-style declaration detection: type name */
+            if (lang == LANG_JAVA && tok_count >= 2 && table[tok_count - 2].attribute == 1 && table[tok_count - 1].attribute == 2)
             {
-                add_decl(table[tok_count - 1].token, table[tok_count - 2].token, table[tok_count - 1].line);
+                add_decl(table[tok_count - 1].token, table[tok_count - 2].token, table[tok_count - 1].line, pending_doc, depth);
+                pending_doc = -1;
             }
             continue;
         }
@@ -448,107 +966,28 @@ int tokenize_and_build(const char *filename)
         /* numbers */
         if (isdigit(ch))
         {
-            char buf[512];
-            int idx = 0;
-            buf[idx++] = (char)ch;
             int c2;
-            while ((c2 = getc_nl(fp, &line)) != EOF && (isdigit(c2) || c2 == '.'))
-            {
-                if (idx < (int)sizeof(buf) - 1)
-                    buf[idx++] = (char)c2;
-            }
+            while ((c2 = getc_nl(src, &line)) != EOF && (isdigit(c2) || c2 == '.'))
+                ;
             while (c2 != EOF && isalpha(c2))
-            {
-                if (idx < (int)sizeof(buf) - 1)
-                    buf[idx++] = (char)c2;
-                c2 = getc_nl(fp, &line);
-            }
+                c2 = getc_nl(src, &line);
             if (c2 != EOF)
-                ungetc_nl(c2, fp, &line);
-            buf[idx] = 0;
-            strcpy(table[tok_count].token, buf);
-            table[tok_count].attribute = 3;
-            table[tok_count].line = line;
-            tok_count++;
-            continue;
-        }
-
-        /* char literal */
-        if (ch == '\'')
-        {
-            char buf[128];
-            int idx = 0;
-            buf[idx++] = '\'';
-            int c2 = getc_nl(fp, &line);
-            if (c2 == '\\')
-            {
-                if (idx < (int)sizeof(buf) - 1)
-                    buf[idx++] = '\\';
-                int c3 = getc_nl(fp, &line);
-                if (c3 != EOF && idx < (int)sizeof(buf) - 1)
-                    buf[idx++] = (char)c3;
-            }
-            else if (c2 != EOF)
-            {
-                if (idx < (int)sizeof(buf) - 1)
-                    buf[idx++] = (char)c2;
-            }
-            int cend = getc_nl(fp, &line);
-            if (cend == '\'' && idx < (int)sizeof(buf) - 1)
-                buf[idx++] = '\'';
-            buf[idx] = 0;
-            strcpy(table[tok_count].token, buf);
-            table[tok_count].attribute = 7;
-            table[tok_count].line = line;
-            tok_count++;
-            continue;
-        }
-
-        /* string literal */
-        if (ch == '"')
-        {
-            char buf[1024];
-            int idx = 0;
-            buf[idx++] = '"';
-            int c2;
-            while ((c2 = getc_nl(fp, &line)) != EOF && c2 != '"')
-            {
-                if (c2 == '\\')
-                {
-                    if (idx < (int)sizeof(buf) - 2)
-                    {
-                        buf[idx++] = (char)c2;
-                        int c3 = getc_nl(fp, &line);
-                        if (c3 != EOF)
-                            buf[idx++] = (char)c3;
-                    }
-                }
-                else
-                {
-                    if (idx < (int)sizeof(buf) - 1)
-                        buf[idx++] = (char)c2;
-                }
-            }
-            if (c2 == '"' && idx < (int)sizeof(buf) - 1)
-                buf[idx++] = '"';
-            buf[idx] = 0;
-            strcpy(table[tok_count].token, buf);
-            table[tok_count].attribute = 6;
-            table[tok_count].line = line;
-            tok_count++;
+                ungetc_nl(c2, src, &line);
+            size_t tok_end = tok_span_end(src);
+            add_token(span_text(src, tok_start, tok_end), 3, line, tok_start, tok_end);
             continue;
         }
 
-        /* operators / punctuation - include Kotlin combos, treat ':' as separator */
+        /* operators / punctuation - Kotlin adds ?. ?: and .., treat ':' as separator */
         if (strchr("+-*/%=<>!&|?:.()", ch) || ch == ':')
         {
             char buf[16];
             int idx = 0;
             buf[idx++] = (char)ch;
-            int n = getc_nl(fp, &line);
+            int n = getc_nl(src, &line);
             if (n != EOF)
             {
-                if ((buf[0] == '?' && n == '.') || (buf[0] == '?' && n == ':') || (buf[0] == '.' && n == '.') ||
+                if ((lang == LANG_KOTLIN && ((buf[0] == '?' && n == '.') || (buf[0] == '?' && n == ':') || (buf[0] == '.' && n == '.'))) ||
                     (buf[0] == '=' && n == '=') || (buf[0] == '!' && n == '=') || (buf[0] == '<' && n == '=') || (buf[0] == '>' && n == '=') ||
                     (buf[0] == '&' && n == '&') || (buf[0] == '|' && n == '|'))
                 {
@@ -558,7 +997,7 @@ int tokenize_and_build(const char *filename)
                 {
                     if (buf[0] == '=' && n == '=')
                     {
-                        int n2 = getc_nl(fp, &line);
+                        int n2 = getc_nl(src, &line);
                         if (n2 == '=')
                         {
                             buf[idx++] = (char)n;
@@ -566,69 +1005,90 @@ int tokenize_and_build(const char *filename)
                         }
                         else
                         {
-                            ungetc_nl(n2, fp, &line);
-                            ungetc_nl(n, fp, &line);
+                            ungetc_nl(n2, src, &line);
+                            ungetc_nl(n, src, &line);
                         }
                     }
                     else
-                        ungetc_nl(n, fp, &line);
+                        ungetc_nl(n, src, &line);
                 }
             }
-            buf[idx] = 0;
             int attr = 4;
             if (buf[0] == ':' && idx == 1)
                 attr = 5;
-            strcpy(table[tok_count].token, buf);
-            table[tok_count].attribute = attr;
-            table[tok_count].line = line;
-            tok_count++;
+            add_token(intern(buf, (size_t)idx), attr, line, tok_start, tok_span_end(src));
             continue;
         }
 
         /* separators */
         if (strchr("{}[];,", ch))
         {
-            char buf[4] = {(char)ch, 0, 0, 0};
-            strcpy(table[tok_count].token, buf);
-            table[tok_count].attribute = 5;
-            table[tok_count].line = line;
-            tok_count++;
+            char sep = (char)ch;
+            add_token(intern(&sep, 1), 5, line, tok_start, tok_span_end(src));
+            if (ch == ';' || ch == '{' || ch == '}')
+                pending_doc = -1;
+            if (ch == '{')
+                depth++;
+            else if (ch == '}' && depth > 0)
+                depth--;
             continue;
         }
 
         /* else ignore */
     } /* end while */
 
-    fclose(fp);
-
-    /* Kotlin var/val detection & E1 check */
-    for (int i = 0; i < tok_count; i++)
+    /* Kotlin declarations: var/val name [: Type] with E1 check, fun/class/object name */
+    if (lang == LANG_KOTLIN)
     {
-        if (table[i].attribute == 1 && (strcmp(table[i].token, "var") == 0 || strcmp(table[i].token, "val") == 0))
+        pending_doc = -1;
+        depth = 0;
+        int doc_cursor = 0;
+        for (int i = 0; i < tok_count; i++)
         {
-            if (i + 1 < tok_count && table[i + 1].attribute == 2)
+            if (table[i].attribute == 5 && table[i].token[0] == '{')
+                depth++;
+            else if (table[i].attribute == 5 && table[i].token[0] == '}' && depth > 0)
+                depth--;
+            /* replay doc comments in token order so these declarations get theirs too */
+            for (; doc_cursor < com_count && comments[doc_cursor].next_tok <= i; doc_cursor++)
+                if (comments[doc_cursor].next_tok >= 0)
+                    pending_doc = doc_cursor;
+            if (table[i].attribute == 5 && (table[i].token[0] == ';' || table[i].token[0] == '{' || table[i].token[0] == '}'))
+                pending_doc = -1;
+
+            if (table[i].attribute == 1 && (strcmp(table[i].token, "var") == 0 || strcmp(table[i].token, "val") == 0))
             {
-                const char *name = table[i + 1].token;
-                if (i + 2 < tok_count && strcmp(table[i + 2].token, ":") == 0 && i + 3 < tok_count)
+                if (i + 1 < tok_count && table[i + 1].attribute == 2)
                 {
-                    const char *type = table[i + 3].token;
-                    char typbuf[128];
-                    strncpy(typbuf, type, sizeof(typbuf) - 1);
-                    typbuf[sizeof(typbuf) - 1] = 0;
-                    int lt = (int)strlen(typbuf);
-                    if (lt > 0 && typbuf[lt - 1] == '?')
-                        typbuf[lt - 1] = 0;
-                    add_decl(name, typbuf, table[i + 1].line);
-                    if (i + 4 < tok_count && strcmp(table[i + 4].token, "=") == 0 && i + 5 < tok_count)
+                    const char *name = table[i + 1].token;
+                    if (i + 2 < tok_count && strcmp(table[i + 2].token, ":") == 0 && i + 3 < tok_count)
+                    {
+                        const char *type = table[i + 3].token;
+                        size_t lt = strlen(type);
+                        if (lt > 0 && type[lt - 1] == '?')
+                            type = intern(type, lt - 1);
+                        if (!type)
+                            continue;
+                        add_decl(name, type, table[i + 1].line, pending_doc, depth);
+                        pending_doc = -1;
+                        if (i + 4 < tok_count && strcmp(table[i + 4].token, "=") == 0 && i + 5 < tok_count)
+                        {
+                            const char *valtok = table[i + 5].token;
+                            check_assignment_type(type, valtok, table[i + 1].line, name);
+                        }
+                    }
+                    else if (i + 2 < tok_count && strcmp(table[i + 2].token, "=") == 0)
                     {
-                        const char *valtok = table[i + 5].token;
-                        check_assignment_type(typbuf, valtok, table[i + 1].line, name);
+                        add_decl(name, "UNKNOWN", table[i + 1].line, pending_doc, depth);
+                        pending_doc = -1;
                     }
                 }
-                else if (i + 2 < tok_count && strcmp(table[i + 2].token, "=") == 0)
-                {
-                    add_decl(name, "UNKNOWN", table[i + 1].line);
-                }
+            }
+            else if (table[i].attribute == 1 && i + 1 < tok_count && table[i + 1].attribute == 2 &&
+                     (strcmp(table[i].token, "fun") == 0 || strcmp(table[i].token, "class") == 0 || strcmp(table[i].token, "object") == 0))
+            {
+                add_decl(table[i + 1].token, table[i].token, table[i + 1].line, pending_doc, depth);
+                pending_doc = -1;
             }
         }
     }
@@ -636,21 +1096,247 @@ int tokenize_and_build(const char *filename)
     return 1;
 }
 
-/* PASS 2: detect errors E1..E4 */
-void detect_errors_pass2(void)
+/* the two instantiations */
+static int tokenize_java(const char *text, size_t len) { return tokenize_impl(text, len, LANG_JAVA); }
+static int tokenize_kotlin(const char *text, size_t len) { return tokenize_impl(text, len, LANG_KOTLIN); }
+
+static int tokenize_buffer(const char *text, size_t len, int lang)
 {
-    for (int i = 0; i < tok_count; i++)
-    {
-        struct Symbol *t = &table[i];
+    return lang == LANG_KOTLIN ? tokenize_kotlin(text, len) : tokenize_java(text, len);
+}
 
-        /* E2 - misspelled keyword */
-        if (t->attribute == 2)
+/* language is chosen once per file: explicit, else by extension (.kt/.kts = Kotlin) */
+static int lang_for_file(const char *fname, int lang)
+{
+    if (lang != LANG_AUTO)
+        return lang;
+    const char *dot = strrchr(fname, '.');
+    return (dot && (strcmp(dot, ".kt") == 0 || strcmp(dot, ".kts") == 0)) ? LANG_KOTLIN : LANG_JAVA;
+}
+
+/* read the whole file into a per-thread buffer (reused across files); NULL if unreadable */
+static const char *load_file(const char *filename, size_t *out_len)
+{
+    static __thread char *file_buf;
+    static __thread size_t file_cap;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return NULL;
+    size_t len = 0, got;
+    do
+    {
+        if (len == file_cap)
         {
-            if (!isDeclared(t->token) && similarToKeyword(t->token))
+            size_t cap = file_cap ? file_cap * 2 : 65536;
+            char *grown = realloc(file_buf, cap);
+            if (!grown)
             {
-                int prev_is_keyword = (i > 0 && table[i - 1].attribute == 1);
-                if (!prev_is_keyword)
-                {
+                fclose(fp);
+                return NULL;
+            }
+            file_buf = grown;
+            file_cap = cap;
+        }
+        got = fread(file_buf + len, 1, file_cap - len, fp);
+        len += got;
+    } while (got > 0);
+    fclose(fp);
+    *out_len = len;
+    return file_buf;
+}
+
+int tokenize_and_build(const char *filename)
+{
+    size_t len;
+    const char *text = load_file(filename, &len);
+    return text ? tokenize_buffer(text, len, lang_for_file(filename, LANG_AUTO)) : 0;
+}
+
+/* ---------- Project-wide declaration index ----------
+   Built by --index from every .java/.kt file of a tree; analysis with --project
+   resolves identifiers against it (imports, declarations of the same package or
+   of a wildcard-imported one) before reporting E3. The file is used in place
+   through mmap, everything is referenced by offset:
+     struct IdxHeader
+     struct IdxFile  files[nfiles]  path, package, mtime/size (for refresh)
+     struct IdxSym   syms[nsyms]    top-level declarations, grouped by file
+     uint32_t        slots[nslots]  open addressing on name hash: sym index + 1, 0 = empty
+     char            strings[]      NUL-terminated
+*/
+#define IDX_MAGIC "LXIDX01"
+struct IdxHeader
+{
+    char magic[8];
+    uint32_t nfiles, nsyms, nslots, strings_size;
+};
+struct IdxFile
+{
+    uint32_t path, package;
+    int64_t mtime, size;
+    uint32_t first_sym, nsyms;
+};
+struct IdxSym
+{
+    uint32_t name, package, file;
+    int32_t line;
+};
+struct ProjectIndex
+{
+    void *map;
+    size_t map_size;
+    const struct IdxHeader *hdr;
+    const struct IdxFile *files;
+    const struct IdxSym *syms;
+    const uint32_t *slots;
+    const char *strings;
+};
+
+/* index used to resolve identifiers (--project); read-only, shared by all threads */
+static struct ProjectIndex *project;
+
+static int index_open(struct ProjectIndex *ix, const char *path)
+{
+    memset(ix, 0, sizeof(*ix));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct IdxHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    const struct IdxHeader *h = map;
+    size_t need = sizeof(*h) + (size_t)h->nfiles * sizeof(struct IdxFile) + (size_t)h->nsyms * sizeof(struct IdxSym) +
+                  (size_t)h->nslots * sizeof(uint32_t) + h->strings_size;
+    if (memcmp(h->magic, IDX_MAGIC, sizeof(h->magic)) != 0 || need != (size_t)st.st_size ||
+        h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0)
+    {
+        munmap(map, (size_t)st.st_size);
+        return 0;
+    }
+    ix->map = map;
+    ix->map_size = (size_t)st.st_size;
+    ix->hdr = h;
+    ix->files = (const struct IdxFile *)(h + 1);
+    ix->syms = (const struct IdxSym *)(ix->files + h->nfiles);
+    ix->slots = (const uint32_t *)(ix->syms + h->nsyms);
+    ix->strings = (const char *)(ix->slots + h->nslots);
+    return 1;
+}
+
+static void index_close(struct ProjectIndex *ix)
+{
+    if (ix->map)
+        munmap(ix->map, ix->map_size);
+    memset(ix, 0, sizeof(*ix));
+}
+
+/* next symbol called name, probing from *pos (start with *pos = 0); NULL when done */
+static const struct IdxSym *index_next(const struct ProjectIndex *ix, const char *name, uint32_t *pos)
+{
+    uint32_t n = ix->hdr->nslots, h = hash_str(name);
+    while (*pos < n)
+    {
+        uint32_t v = ix->slots[(h + (*pos)++) & (n - 1)];
+        if (v == 0)
+            break;
+        const struct IdxSym *sym = &ix->syms[v - 1];
+        if (strcmp(ix->strings + sym->name, name) == 0)
+            return sym;
+    }
+    *pos = n;
+    return NULL;
+}
+
+/* package and imports of the file in the tables (NAMESPACE tokens after package/import) */
+#define MAX_IMPORTS 512
+static __thread const char *cur_package;
+static __thread const char *imports[MAX_IMPORTS];
+static __thread const char *import_names[MAX_IMPORTS]; /* simple name (or alias) of each import */
+static __thread size_t import_lens[MAX_IMPORTS];
+static __thread int import_count;
+
+static void collect_imports(void)
+{
+    cur_package = "";
+    import_count = 0;
+    for (int i = 1; i < tok_count; i++)
+    {
+        if (table[i].attribute != 8 || table[i - 1].attribute != 1)
+            continue;
+        if (strcmp(table[i - 1].token, "package") == 0)
+            cur_package = table[i].token;
+        else if (strcmp(table[i - 1].token, "import") == 0 && import_count < MAX_IMPORTS)
+        {
+            const char *imp = table[i].token;
+            const char *simple = strstr(imp, " as "); /* Kotlin alias */
+            if (simple)
+                simple += 4;
+            else if ((simple = strrchr(imp, '.')))
+                simple++;
+            else
+                simple = imp;
+            while (*simple == ' ')
+                simple++;
+            imports[import_count] = imp;
+            import_names[import_count] = simple;
+            import_lens[import_count++] = strlen(imp);
+        }
+    }
+}
+
+/* does id name something outside this file: an imported name, or a top-level
+   declaration of this package or of a wildcard-imported package? */
+static int project_resolves(const char *id)
+{
+    if (!project)
+        return 0;
+    for (int k = 0; k < import_count; k++)
+        if (strcmp(import_names[k], id) == 0)
+            return 1;
+    uint32_t pos = 0;
+    const struct IdxSym *sym;
+    while ((sym = index_next(project, id, &pos)))
+    {
+        const char *pkg = project->strings + sym->package;
+        if (strcmp(pkg, cur_package) == 0)
+            return 1;
+        size_t plen = strlen(pkg);
+        for (int k = 0; k < import_count; k++)
+            if (import_lens[k] == plen + 2 && memcmp(imports[k], pkg, plen) == 0 && strcmp(imports[k] + plen, ".*") == 0)
+                return 1;
+    }
+    return 0;
+}
+
+static int isKnown(const char *id)
+{
+    return isDeclared(id) || project_resolves(id);
+}
+
+/* PASS 2: detect errors E1..E4 */
+LANG_SPECIALIZED void detect_errors_impl(const int lang)
+{
+    if (project)
+        collect_imports();
+    /* this pass only reports: once the error table is full nothing else can change */
+    for (int i = 0; i < tok_count && err_count < MAX_ERRORS; i++)
+    {
+        struct Symbol *t = &table[i];
+
+        /* E2 - misspelled keyword */
+        if (t->attribute == 2)
+        {
+            if (!isKnown(t->token) && similarToKeyword(t->token, lang))
+            {
+                int prev_is_keyword = (i > 0 && table[i - 1].attribute == 1);
+                if (!prev_is_keyword)
+                {
                     char buf[256];
                     snprintf(buf, sizeof(buf), "E2-MisspelledKeyword: '%s' resembles a keyword", t->token);
                     report_error(buf, t->line);
@@ -661,11 +1347,11 @@ void detect_errors_pass2(void)
         /* E3 - identifier used before declaration */
         if (t->attribute == 2)
         {
-            int prev_is_decl_keyword = (i > 0 && table[i - 1].attribute == 1 && (strcmp(table[i - 1].token, "var") == 0 || strcmp(table[i - 1].token, "val") == 0 || isKeyword(table[i - 1].token)));
-            if (!prev_is_decl_keyword && !isDeclared(t->token))
+            int prev_is_decl_keyword = (i > 0 && table[i - 1].attribute == 1 && (strcmp(table[i - 1].token, "var") == 0 || strcmp(table[i - 1].token, "val") == 0 || isKeyword(table[i - 1].token, lang)));
+            if (!prev_is_decl_keyword && !isKnown(t->token))
             {
                 char buf[256];
-                snprintf(buf, sizeof(buf), "E3-IdentifierError: '%s' used before declaration", t->token);
+                snprintf(buf, sizeof(buf), "E3-IdentifierError: '%.200s' used before declaration", t->token);
                 report_error(buf, t->line);
             }
         }
@@ -675,10 +1361,10 @@ void detect_errors_pass2(void)
         {
             const char *id = table[i].token;
             const char *valtok = table[i + 2].token;
-            if (!isDeclared(id))
+            if (!isKnown(id))
             {
                 char buf[256];
-                snprintf(buf, sizeof(buf), "E3-IdentifierError: '%s' used before declaration", id);
+                snprintf(buf, sizeof(buf), "E3-IdentifierError: '%.200s' used before declaration", id);
                 report_error(buf, table[i].line);
             }
             else
@@ -712,6 +1398,14 @@ void detect_errors_pass2(void)
     }
 }
 
+void detect_errors_pass2(void)
+{
+    if (cur_lang == LANG_KOTLIN)
+        detect_errors_impl(LANG_KOTLIN);
+    else
+        detect_errors_impl(LANG_JAVA);
+}
+
 /* comparator: sort by line then token */
 int cmpSymbols(const void *a, const void *b)
 {
@@ -723,19 +1417,22 @@ int cmpSymbols(const void *a, const void *b)
 }
 
 /* Small animation for drawing a horizontal line */
-static void animated_hline(int width)
+static void animated_hline(FILE *out, int width)
 {
     for (int i = 0; i < width; i++)
     {
-        putchar('-');
-        fflush(stdout);
-        usleep(1500); /* 1.5ms per char -> subtle */
+        putc('-', out);
+        if (animate)
+        {
+            fflush(out);
+            usleep(1500); /* 1.5ms per char -> subtle */
+        }
     }
-    putchar('\n');
+    putc('\n', out);
 }
 
 /* Print Symbol Table first (colored per attribute & token) */
-void print_symbol_table_box(void)
+void print_symbol_table_box(FILE *out)
 {
     /* sort tokens by line */
     qsort(table, tok_count, sizeof(struct Symbol), cmpSymbols);
@@ -744,11 +1441,11 @@ void print_symbol_table_box(void)
     int total = col1 + col2 + col3 + 6;
 
     /* header */
-    printf("\n%s", PASTEL_HDR_BG);
-    animated_hline(total);
-    printf("| %-*s | %-*s | %-*s |\n", col1, "TOKEN", col2, "ATTRIBUTE", col3, "LINE");
-    animated_hline(total);
-    printf("%s", COL_RESET);
+    fprintf(out, "\n%s", PASTEL_HDR_BG);
+    animated_hline(out, total);
+    fprintf(out, "| %-*s | %-*s | %-*s |\n", col1, "TOKEN", col2, "ATTRIBUTE", col3, "LINE");
+    animated_hline(out, total);
+    fprintf(out, "%s", COL_RESET);
 
     for (int i = 0; i < tok_count; i++)
     {
@@ -758,59 +1455,79 @@ void print_symbol_table_box(void)
         strncpy(token_display, table[i].token, col1 - 1);
         token_display[col1 - 1] = 0;
 
-        printf("| %s%-*s%s | %s%-*s%s | %*d |\n",
-               tokcol, col1, token_display, COL_RESET,
-               attrcol, col2, attrLabel(table[i].attribute), COL_RESET,
-               col3 - 1, table[i].line);
+        fprintf(out, "| %s%-*s%s | %s%-*s%s | %*d |\n",
+                tokcol, col1, token_display, COL_RESET,
+                attrcol, col2, attrLabel(table[i].attribute), COL_RESET,
+                col3 - 1, table[i].line);
     }
 
-    animated_hline(total);
+    animated_hline(out, total);
 }
 
 /* Print comments second (soft blue) */
-void print_comments_box(const char *fname)
+void print_comments_box(FILE *out, const char *fname)
 {
     (void)fname;
     int width = 65;
-    printf("\n");
-    printf("%s", PASTEL_HDR_BG);
-    animated_hline(width);
-    printf("| %-*s |\n", width - 4, "COMMENTS");
-    animated_hline(width);
-    printf("%s", COL_RESET);
+    fprintf(out, "\n");
+    fprintf(out, "%s", PASTEL_HDR_BG);
+    animated_hline(out, width);
+    fprintf(out, "| %-*s |\n", width - 4, "COMMENTS");
+    animated_hline(out, width);
+    fprintf(out, "%s", COL_RESET);
 
     if (com_count == 0)
     {
-        printf("| %s(no comments found)%s\n", PASTEL_COMMENT, COL_RESET);
-        animated_hline(width);
+        fprintf(out, "| %s(no comments found)%s\n", PASTEL_COMMENT, COL_RESET);
+        animated_hline(out, width);
         return;
     }
     for (int i = 0; i < com_count; i++)
     {
         char buf[58];
-        strncpy(buf, comments[i], sizeof(buf) - 1);
-        buf[sizeof(buf) - 1] = 0;
+        int n = 0;
+        for (int k = 0; k < comments[i].len && n < (int)sizeof(buf) - 1; k++)
+            if (comments[i].text[k] != '\r')
+                buf[n++] = comments[i].text[k];
+        buf[n] = 0;
         /* print comment line with pastel blue */
-        printf("| %s%-58s%s |\n", PASTEL_COMMENT, buf, COL_RESET);
+        fprintf(out, "| %s%-58s%s |\n", PASTEL_COMMENT, buf, COL_RESET);
+    }
+    animated_hline(out, width);
+}
+
+/* count errors per kind: counts[0] = E1 ... counts[3] = E4 */
+static void count_error_kinds(int counts[4])
+{
+    counts[0] = counts[1] = counts[2] = counts[3] = 0;
+    for (int i = 0; i < err_count; i++)
+    {
+        if (strstr(errors[i].msg, "E1-"))
+            counts[0]++;
+        if (strstr(errors[i].msg, "E2-"))
+            counts[1]++;
+        if (strstr(errors[i].msg, "E3-"))
+            counts[2]++;
+        if (strstr(errors[i].msg, "E4-"))
+            counts[3]++;
     }
-    animated_hline(width);
 }
 
 /* Print errors last, colored by type */
-void print_errors_and_summary_box(void)
+void print_errors_and_summary_box(FILE *out)
 {
     int width = 70;
-    printf("\n");
-    printf("%s", PASTEL_HDR_BG);
-    animated_hline(width);
-    printf("| %-*s |\n", width - 4, "ERROR REPORT");
-    animated_hline(width);
-    printf("%s", COL_RESET);
+    fprintf(out, "\n");
+    fprintf(out, "%s", PASTEL_HDR_BG);
+    animated_hline(out, width);
+    fprintf(out, "| %-*s |\n", width - 4, "ERROR REPORT");
+    animated_hline(out, width);
+    fprintf(out, "%s", COL_RESET);
 
     if (err_count == 0)
     {
-        printf("%sNo errors found.%s\n", PASTEL_IDENT, COL_RESET);
-        animated_hline(width);
+        fprintf(out, "%sNo errors found.%s\n", PASTEL_IDENT, COL_RESET);
+        animated_hline(out, width);
         return;
     }
 
@@ -820,25 +1537,317 @@ void print_errors_and_summary_box(void)
         char msgbuf[64];
         strncpy(msgbuf, errors[i].msg, sizeof(msgbuf) - 1);
         msgbuf[sizeof(msgbuf) - 1] = 0;
-        printf("| %s%-60s%s | %3d |\n", col, msgbuf, COL_RESET, errors[i].line);
+        fprintf(out, "| %s%-60s%s | %3d |\n", col, msgbuf, COL_RESET, errors[i].line);
     }
 
-    animated_hline(width);
+    animated_hline(out, width);
 
     /* summary counts */
-    int e1 = 0, e2 = 0, e3 = 0, e4 = 0;
+    int e[4];
+    count_error_kinds(e);
+    fprintf(out, "%sSummary:%s E1=%d  E2=%d  E3=%d  E4=%d   Total=%d\n", PASTEL_IDENT, COL_RESET, e[0], e[1], e[2], e[3], err_count);
+}
+
+/* tab-separated text with \t, \n and \\ escaped (machine-readable output) */
+static void put_escaped(FILE *out, const char *s, size_t n)
+{
+    for (const char *end = s + n; s < end; s++)
+    {
+        if (*s == '\r')
+            fputs("\\r", out);
+        else if (*s == '\t')
+            fputs("\\t", out);
+        else if (*s == '\n')
+            fputs("\\n", out);
+        else if (*s == '\\')
+            fputs("\\\\", out);
+        else
+            putc(*s, out);
+    }
+}
+
+/* Plain report: one record per line, T(oken) / C(omment) / E(rror) / S(ummary) */
+static void print_tsv_report(FILE *out, const char *fname)
+{
+    for (int i = 0; i < tok_count; i++)
+    {
+        fprintf(out, "T\t%d\t%s\t", table[i].line, attrLabel(table[i].attribute));
+        put_escaped(out, table[i].token, strlen(table[i].token));
+        putc('\n', out);
+    }
+    for (int i = 0; i < com_count; i++)
+    {
+        fprintf(out, "C\t%d\t%d\t", comments[i].line, comments[i].end_line);
+        put_escaped(out, comments[i].text, (size_t)comments[i].len);
+        putc('\n', out);
+    }
     for (int i = 0; i < err_count; i++)
     {
-        if (strstr(errors[i].msg, "E1-"))
-            e1++;
-        if (strstr(errors[i].msg, "E2-"))
-            e2++;
-        if (strstr(errors[i].msg, "E3-"))
-            e3++;
-        if (strstr(errors[i].msg, "E4-"))
-            e4++;
+        fprintf(out, "E\t%d\t", errors[i].line);
+        put_escaped(out, errors[i].msg, strlen(errors[i].msg));
+        putc('\n', out);
+    }
+    int e[4];
+    count_error_kinds(e);
+    fprintf(out, "S\t%s\ttokens=%d\tcomments=%d\tE1=%d\tE2=%d\tE3=%d\tE4=%d\ttotal=%d\n",
+            fname, tok_count, com_count, e[0], e[1], e[2], e[3], err_count);
+}
+
+/* Declaration -> doc comment index: D, name, type, line, doc line, doc text */
+static void print_doc_index(FILE *out)
+{
+    for (int i = 0; i < decl_count; i++)
+    {
+        if (decls[i].doc < 0)
+            continue;
+        const struct Comment *c = &comments[decls[i].doc];
+        fprintf(out, "D\t%s\t%s\t%d\t%d\t", decls[i].name, decls[i].type, decls[i].line, c->line);
+        put_escaped(out, c->text, (size_t)c->len);
+        putc('\n', out);
+    }
+}
+
+/* One line per file */
+static void print_summary_line(FILE *out, const char *fname)
+{
+    int e[4];
+    count_error_kinds(e);
+    fprintf(out, "%s: tokens=%d comments=%d E1=%d E2=%d E3=%d E4=%d Total=%d\n",
+            fname, tok_count, com_count, e[0], e[1], e[2], e[3], err_count);
+}
+
+/* Print the report for the file in the tables in the requested format */
+static void print_report(FILE *out, const char *fname, int fmt)
+{
+    if (fmt == FMT_TSV)
+        print_tsv_report(out, fname);
+    else if (fmt == FMT_SUMMARY)
+        print_summary_line(out, fname);
+    else if (fmt == FMT_DOCS)
+        print_doc_index(out);
+    else
+    {
+        print_symbol_table_box(out);
+        print_comments_box(out, fname);
+        print_errors_and_summary_box(out);
+    }
+}
+
+/* Run both passes over a file (buf == NULL) or an in-memory source and print
+   the report. Returns 0 if the source could not be read. */
+static int analyze_source(const char *fname, const char *buf, size_t len, int lang, int fmt, FILE *out)
+{
+    if (!buf && !(buf = load_file(fname, &len)))
+        return 0;
+    if (!tokenize_buffer(buf, len, lang_for_file(fname, lang)))
+        return 0;
+    detect_errors_pass2();
+    print_report(out, fname, fmt);
+    return 1;
+}
+
+/* --bench: time both passes per file (source already in memory, no output),
+   then throughput per language */
+static int run_bench(char **files, int nfiles, int lang, int iters)
+{
+    double secs[3] = {0}, bytes[3] = {0}, toks[3] = {0};
+    int status = 0;
+    for (int f = 0; f < nfiles; f++)
+    {
+        size_t len;
+        const char *text = load_file(files[f], &len);
+        if (!text)
+        {
+            fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, files[f]);
+            status = 1;
+            continue;
+        }
+        int l = lang_for_file(files[f], lang);
+        double t0 = now_sec();
+        for (int it = 0; it < iters; it++)
+        {
+            tokenize_buffer(text, len, l);
+            detect_errors_pass2();
+        }
+        double dt = now_sec() - t0;
+        printf("%-40s %-6s %9zu bytes %7d tokens %8.2f MB/s %10.0f tokens/s\n", files[f], l == LANG_KOTLIN ? "kotlin" : "java",
+               len, tok_count, len * (double)iters / dt / 1e6, tok_count * (double)iters / dt);
+        secs[l] += dt;
+        bytes[l] += (double)len * iters;
+        toks[l] += (double)tok_count * iters;
+    }
+    for (int l = LANG_JAVA; l <= LANG_KOTLIN; l++)
+        if (secs[l] > 0)
+            printf("%-40s %-6s %8.2f MB/s %10.0f tokens/s\n", "total", l == LANG_KOTLIN ? "kotlin" : "java",
+                   bytes[l] / secs[l] / 1e6, toks[l] / secs[l]);
+    size_t high = arena.taken > arena.high ? arena.taken : arena.high;
+    printf("arena: %ld chunk allocations, %ld chunk frees (%.2f ms) over %d passes, high water %zu KB\n", arena_mallocs, arena_frees,
+           arena_nsecs / 1e6, nfiles * iters, high / 1024);
+    return status;
+}
+
+/* ---------- Adversarial inputs (--stress MB) ----------
+   Pathological sources seen in generated code, built in memory at the given
+   size. Analysis (both passes) must stay linear on each of them: its time
+   per byte may not exceed STRESS_FACTOR times that of ordinary code, may not
+   grow by more than STRESS_GROWTH when the input grows eightfold, and the
+   arena may hold at most STRESS_MEM bytes per input byte. Ordinary code in
+   turn may cost at most STRESS_SCAN times a plain scan (one long comment),
+   so a slowdown everywhere fails as well. */
+
+#define STRESS_FACTOR 4.0
+#define STRESS_GROWTH 2.0
+#define STRESS_MEM 48.0
+#define STRESS_SCAN 32.0
+
+enum
+{
+    STRESS_BASE,
+    STRESS_ONE_LINE,
+    STRESS_OPEN_COMMENT,
+    STRESS_OPEN_STRING,
+    STRESS_LONG_IDENT,
+    STRESS_CR,
+    STRESS_PACKAGE,
+    STRESS_DECLS,
+    STRESS_COUNT
+};
+static const char *const stress_names[STRESS_COUNT] = {"ordinary code", "single line", "open /* to EOF", "open \" to EOF",
+                                                       "long identifiers", "\\r runs", "package/import lines", "distinct decls"};
+
+/* one repeatable piece of input number k; returns its length (at most 8 KB) */
+static size_t stress_piece(int kind, char *out, long k)
+{
+    size_t n = 0;
+    switch (kind)
+    {
+    case STRESS_BASE:
+    case STRESS_OPEN_COMMENT: /* no close-comment inside */
+        return (size_t)sprintf(out, "    public int method%ld(int a%ld) {\n        int v%ld = a%ld + %ld * count; // step\n"
+                                    "        String s%ld = \"v\" + v%ld;\n        if (v%ld <= a%ld) v%ld = 0;\n    }\n",
+                               k, k, k, k, k % 97, k, k, k, k, k);
+    case STRESS_ONE_LINE:
+        return (size_t)sprintf(out, "public int method%ld(int a%ld) { int v%ld = a%ld + %ld * count; /* step */ "
+                                    "String s%ld = \"v\" + v%ld; if (v%ld <= a%ld) v%ld = 0; } ",
+                               k, k, k, k, k % 97, k, k, k, k, k);
+    case STRESS_OPEN_STRING: /* no quote inside */
+        return (size_t)sprintf(out, "        total%ld = total + step * 2; // it's\n", k % 1000);
+    case STRESS_LONG_IDENT:
+        n = (size_t)sprintf(out, "int x%ld_", k);
+        for (size_t len = 300 + (size_t)(k % 8) * 500; n < len; n++)
+            out[n] = (char)('a' + n % 26);
+        return n + (size_t)sprintf(out + n, " = y%ld;\n", k);
+    case STRESS_CR:
+        n = (size_t)sprintf(out, "int v%ld", k);
+        memset(out + n, '\r', 4096);
+        n += 4096;
+        return n + (size_t)sprintf(out + n, "= v%ld +\r\r\r1;\r\n", k);
+    case STRESS_PACKAGE:
+        return (size_t)sprintf(out, "package a.b.c%ld;\nimport java.util.List%ld;\nimport kotlin.x%ld.*;\npackage\n", k, k, k % 7);
+    default:
+        return (size_t)sprintf(out, "int d%ld = d%ld + 1;\n", k, k - 1);
+    }
+}
+
+/* build a case of exactly n bytes (the last piece is cut short) */
+static void stress_fill(int kind, char *buf, size_t n)
+{
+    char piece[8192];
+    size_t len = 0;
+    if (kind == STRESS_OPEN_COMMENT || kind == STRESS_OPEN_STRING)
+        buf[len++] = kind == STRESS_OPEN_COMMENT ? '/' : '"';
+    if (kind == STRESS_OPEN_COMMENT)
+        buf[len++] = '*';
+    for (long k = 0; len < n; k++)
+    {
+        size_t m = stress_piece(kind, piece, k);
+        if (m > n - len)
+            m = n - len;
+        memcpy(buf + len, piece, m);
+        len += m;
+    }
+}
+
+/* seconds per byte of both passes over buf: best run, at least two runs and
+   0.2 s in total; *mem gets arena bytes per input byte */
+static double stress_time(const char *buf, size_t n, int lang, double *mem)
+{
+    double best = 0, total = 0;
+    for (int run = 0; run < 2 || total < 0.2; run++)
+    {
+        double t0 = now_sec();
+        tokenize_buffer(buf, n, lang);
+        detect_errors_pass2();
+        double dt = now_sec() - t0;
+        if (run == 0 || dt < best)
+            best = dt;
+        total += dt;
+    }
+    *mem = (double)arena.taken / n;
+    return best / n;
+}
+
+static int run_stress(int mb, int lang)
+{
+    size_t n = (size_t)mb << 20;
+    char *buf = malloc(n);
+    if (!buf)
+    {
+        fprintf(stderr, "%sERROR:%s out of memory\n", PASTEL_ERROR1, COL_RESET);
+        return 1;
     }
-    printf("%sSummary:%s E1=%d  E2=%d  E3=%d  E4=%d   Total=%d\n", PASTEL_IDENT, COL_RESET, e1, e2, e3, e4, err_count);
+    if (lang == LANG_AUTO)
+        lang = LANG_JAVA;
+    printf("%-22s %8s %10s %8s %8s %8s %9s  %s\n", "case", "MB", "ms", "ns/byte", "x base", "growth", "mem B/B", "result");
+    double base = 0, scan = 0;
+    int failures = 0;
+    for (int kind = 0; kind < STRESS_COUNT; kind++)
+    {
+        double mem_small, mem;
+        stress_fill(kind, buf, n / 8);
+        double small = stress_time(buf, n / 8, lang, &mem_small);
+        stress_fill(kind, buf, n);
+        double full = stress_time(buf, n, lang, &mem);
+        if (kind == STRESS_BASE)
+            base = full;
+        if (kind == STRESS_OPEN_COMMENT)
+            scan = full;
+        double factor = full / base, growth = full / small;
+        int ok = factor <= STRESS_FACTOR && growth <= STRESS_GROWTH && mem <= STRESS_MEM;
+        failures += !ok;
+        printf("%-22s %8.1f %10.1f %8.2f %8.2f %8.2f %9.1f  %s\n", stress_names[kind], n / 1048576.0, full * n * 1e3,
+               full * 1e9, factor, growth, mem, ok ? "ok" : "FAIL");
+    }
+    free(buf);
+    int scan_ok = base <= STRESS_SCAN * scan;
+    failures += !scan_ok;
+    printf("%-22s %8s %10s %8s %8.2f %8s %9s  %s\n", "ordinary / scan", "", "", "", base / scan, "", "", scan_ok ? "ok" : "FAIL");
+    printf("limits: x base <= %.1f, growth (n/8 -> n) <= %.1f, mem <= %.0f B/B, ordinary <= %.0f x scan: %s\n", STRESS_FACTOR,
+           STRESS_GROWTH, STRESS_MEM, STRESS_SCAN, failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+static int parse_lang(const char *s)
+{
+    if (!strcmp(s, "java"))
+        return LANG_JAVA;
+    if (!strcmp(s, "kotlin"))
+        return LANG_KOTLIN;
+    if (!strcmp(s, "auto"))
+        return LANG_AUTO;
+    return -1;
+}
+static int parse_format(const char *s)
+{
+    if (!strcmp(s, "box"))
+        return FMT_BOX;
+    if (!strcmp(s, "tsv"))
+        return FMT_TSV;
+    if (!strcmp(s, "summary"))
+        return FMT_SUMMARY;
+    if (!strcmp(s, "docs"))
+        return FMT_DOCS;
+    return -1;
 }
 
 /* Trim helper */
@@ -901,10 +1910,3714 @@ static int prompt_yesno(const char *msg)
     }
 }
 
-/* main loop */
-int main(void)
+/* ---------- Building / updating the project index (--index) ----------
+   Files are lexed in parallel (one set of tables per thread). With an existing
+   index only the files given (and those found under the directories given)
+   are looked at: each replaces its old entry, and one whose mtime and size
+   match keeps its symbols without being lexed again. Every other entry of the
+   old index is copied over as it is, without a stat; an old entry that is
+   named but gone, or lies under a given directory that no longer has it, is
+   removed. So `--index INDEX src/a/A.java` updates a single file. */
+struct ScanSym
+{
+    char *name;
+    int line;
+};
+struct ScanFile
+{
+    char *path;
+    char *package;
+    int64_t mtime, size; /* size < 0: unreadable, left out of the index */
+    struct ScanSym *syms;
+    int nsyms;
+    int relexed;
+    const struct IdxFile *kept; /* unchanged entry of the old index, copied as it is */
+};
+struct PathList
+{
+    char **v;
+    int n, cap;
+};
+struct ScanJob
+{
+    struct ScanFile *files;
+    int nfiles;
+    int next; /* next file to claim (atomic) */
+    const struct ProjectIndex *old;
+    uint32_t *old_slots; /* previous index by path: file index + 1 */
+    uint32_t old_mask;
+};
+
+static int path_push(struct PathList *l, const char *p)
+{
+    if (l->n == l->cap)
+    {
+        int cap = l->cap ? l->cap * 2 : 1024;
+        char **grown = realloc(l->v, (size_t)cap * sizeof(*grown));
+        if (!grown)
+            return 0;
+        l->v = grown;
+        l->cap = cap;
+    }
+    return (l->v[l->n++] = strdup(p)) != NULL;
+}
+
+static int is_source_file(const char *p)
 {
+    const char *dot = strrchr(p, '.');
+    return dot && (strcmp(dot, ".java") == 0 || strcmp(dot, ".kt") == 0 || strcmp(dot, ".kts") == 0);
+}
+
+/* collect .java/.kt files below dir (hidden entries skipped) */
+static void walk_tree(const char *dir, struct PathList *out)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *e;
+    char path[4096];
+    while ((e = readdir(d)))
+    {
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        int is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+            walk_tree(path, out);
+        else if (is_source_file(e->d_name))
+            path_push(out, path);
+    }
+    closedir(d);
+}
+
+/* absolute path of p, also when p itself is gone (its directory is resolved) */
+static char *abs_path(const char *p)
+{
+    char *abs = realpath(p, NULL);
+    if (abs)
+        return abs;
+    const char *slash = strrchr(p, '/');
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (slash == p ? 1 : (int)(slash - p)) : 1, slash ? p : ".");
+    char *d = realpath(dir, NULL);
+    if (!d)
+        return strdup(p);
+    const char *base = slash ? slash + 1 : p;
+    size_t n = strlen(d) + strlen(base) + 2;
+    abs = malloc(n);
+    if (abs)
+        snprintf(abs, n, "%s/%s", strcmp(d, "/") == 0 ? "" : d, base);
+    free(d);
+    return abs;
+}
+
+/* path lies below one of the directories */
+static int under_dir(const struct PathList *dirs, const char *path)
+{
+    for (int i = 0; i < dirs->n; i++)
+    {
+        size_t n = strlen(dirs->v[i]);
+        if (strncmp(path, dirs->v[i], n) == 0 && (path[n] == '/' || (n && dirs->v[i][n - 1] == '/')))
+            return 1;
+    }
+    return 0;
+}
+
+static const struct IdxFile *old_file(const struct ScanJob *job, const char *path)
+{
+    if (!job->old_slots)
+        return NULL;
+    for (uint32_t h = hash_str(path);; h++)
+    {
+        uint32_t v = job->old_slots[h & job->old_mask];
+        if (v == 0)
+            return NULL;
+        const struct IdxFile *f = &job->old->files[v - 1];
+        if (strcmp(job->old->strings + f->path, path) == 0)
+            return f;
+    }
+}
+
+static void scan_file(const struct ScanJob *job, struct ScanFile *f)
+{
+    struct stat st;
+    f->size = -1;
+    if (stat(f->path, &st) < 0)
+        return;
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    const struct IdxFile *old = old_file(job, f->path);
+    if (old && old->mtime == mtime && old->size == (int64_t)st.st_size)
+    {
+        f->package = strdup(job->old->strings + old->package);
+        f->syms = calloc(old->nsyms ? old->nsyms : 1, sizeof(*f->syms));
+        for (uint32_t k = 0; f->syms && k < old->nsyms; k++)
+        {
+            const struct IdxSym *sym = &job->old->syms[old->first_sym + k];
+            f->syms[f->nsyms].name = strdup(job->old->strings + sym->name);
+            f->syms[f->nsyms++].line = sym->line;
+        }
+    }
+    else
+    {
+        size_t len;
+        const char *text = load_file(f->path, &len);
+        if (!text || !tokenize_buffer(text, len, lang_for_file(f->path, LANG_AUTO)))
+            return;
+        collect_imports();
+        f->package = strdup(cur_package);
+        f->syms = calloc(decl_count ? decl_count : 1, sizeof(*f->syms));
+        for (int k = 0; f->syms && k < decl_count; k++)
+        {
+            if (decls[k].depth != 0)
+                continue;
+            f->syms[f->nsyms].name = strdup(decls[k].name);
+            f->syms[f->nsyms++].line = decls[k].line;
+        }
+        f->relexed = 1;
+    }
+    f->mtime = mtime;
+    f->size = (int64_t)st.st_size;
+}
+
+static void *scan_worker(void *arg)
+{
+    struct ScanJob *job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nfiles)
+        scan_file(job, &job->files[i]);
+    return NULL;
+}
+
+/* string pool with interning, offsets are what the index stores */
+struct StrPool
+{
+    char *buf;
+    size_t len, cap;
+    uint32_t *slots; /* offset + 1 */
+    uint32_t mask;
+};
+
+static uint32_t pool_intern(struct StrPool *p, const char *s)
+{
+    uint32_t h = hash_str(s);
+    for (;; h++)
+    {
+        uint32_t v = p->slots[h & p->mask];
+        if (v == 0)
+            break;
+        if (strcmp(p->buf + v - 1, s) == 0)
+            return v - 1;
+    }
+    size_t n = strlen(s) + 1;
+    if (p->len + n > p->cap)
+    {
+        size_t cap = p->cap ? p->cap * 2 : 65536;
+        while (cap < p->len + n)
+            cap *= 2;
+        char *grown = realloc(p->buf, cap);
+        if (!grown)
+            return 0; /* offset 0 is always "" */
+        p->buf = grown;
+        p->cap = cap;
+    }
+    memcpy(p->buf + p->len, s, n);
+    p->slots[h & p->mask] = (uint32_t)p->len + 1;
+    p->len += n;
+    return (uint32_t)(p->len - n);
+}
+
+static uint32_t pow2_at_least(uint64_t n)
+{
+    uint32_t p = 16;
+    while (p < n)
+        p *= 2;
+    return p;
+}
+
+/* write to path.tmp then rename, so readers never map a half-written index */
+static int index_write(const char *path, const struct ScanFile *files, int nfiles, const struct ProjectIndex *old,
+                       uint32_t *out_nsyms)
+{
+    uint32_t nkept = 0, nsyms = 0;
+    for (int i = 0; i < nfiles; i++)
+        if (files[i].size >= 0)
+            nkept++, nsyms += files[i].kept ? files[i].kept->nsyms : (uint32_t)files[i].nsyms;
+
+    struct IdxHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IDX_MAGIC, sizeof(h.magic));
+    h.nfiles = nkept;
+    h.nsyms = nsyms;
+    h.nslots = pow2_at_least((uint64_t)nsyms * 2);
+
+    struct StrPool pool = {0};
+    pool.mask = pow2_at_least(((uint64_t)nkept * 2 + nsyms) * 2) - 1;
+    pool.slots = calloc((size_t)pool.mask + 1, sizeof(uint32_t));
+    struct IdxFile *xf = calloc(nkept ? nkept : 1, sizeof(*xf));
+    struct IdxSym *xs = calloc(nsyms ? nsyms : 1, sizeof(*xs));
+    uint32_t *slots = calloc(h.nslots, sizeof(uint32_t));
+    int ok = pool.slots && xf && xs && slots;
+    if (ok)
+        pool_intern(&pool, "");
+
+    uint32_t fi = 0, si = 0;
+    for (int i = 0; ok && i < nfiles; i++)
+    {
+        const struct ScanFile *f = &files[i];
+        if (f->size < 0)
+            continue;
+        const struct IdxFile *of = f->kept;
+        xf[fi].path = pool_intern(&pool, of ? old->strings + of->path : f->path);
+        xf[fi].package = pool_intern(&pool, of ? old->strings + of->package : f->package ? f->package : "");
+        xf[fi].mtime = of ? of->mtime : f->mtime;
+        xf[fi].size = f->size;
+        xf[fi].first_sym = si;
+        xf[fi].nsyms = of ? of->nsyms : (uint32_t)f->nsyms;
+        for (uint32_t k = 0; k < xf[fi].nsyms; k++, si++)
+        {
+            const char *name = of ? old->strings + old->syms[of->first_sym + k].name : f->syms[k].name;
+            xs[si].name = pool_intern(&pool, name);
+            xs[si].package = xf[fi].package;
+            xs[si].file = fi;
+            xs[si].line = of ? old->syms[of->first_sym + k].line : f->syms[k].line;
+            uint32_t hs = hash_str(name);
+            while (slots[hs & (h.nslots - 1)])
+                hs++;
+            slots[hs & (h.nslots - 1)] = si + 1;
+        }
+        fi++;
+    }
+    h.strings_size = (uint32_t)pool.len;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = ok ? fopen(tmp, "wb") : NULL;
+    if (out)
+    {
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(xf, sizeof(*xf), nkept, out);
+        fwrite(xs, sizeof(*xs), nsyms, out);
+        fwrite(slots, sizeof(uint32_t), h.nslots, out);
+        fwrite(pool.buf, 1, pool.len, out);
+        ok = fclose(out) == 0 && rename(tmp, path) == 0;
+    }
+    else
+        ok = 0;
+    free(pool.buf);
+    free(pool.slots);
+    free(xf);
+    free(xs);
+    free(slots);
+    *out_nsyms = nsyms;
+    return ok;
+}
+
+static int scanned_file(const uint32_t *slots, uint32_t mask, const struct ScanFile *files, const char *path)
+{
+    for (uint32_t h = hash_str(path);; h++)
+    {
+        uint32_t v = slots[h & mask];
+        if (v == 0 || strcmp(files[v - 1].path, path) == 0)
+            return (int)v - 1;
+    }
+}
+
+/* --index INDEX PATH...: build the index from files and directory trees, or
+   update those paths in an existing one */
+static int run_index_build(const char *index_path, char **paths, int npaths, int workers)
+{
+    double t0 = now_sec();
+    struct PathList list = {0}, dirs = {0};
+    for (int i = 0; i < npaths; i++)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            walk_tree(paths[i], &list);
+            char *abs = abs_path(paths[i]);
+            if (abs)
+                path_push(&dirs, abs);
+            free(abs);
+        }
+        else
+            path_push(&list, paths[i]);
+    }
+
+    struct ProjectIndex old;
+    struct ScanJob job;
+    memset(&job, 0, sizeof(job));
+    job.nfiles = list.n;
+    job.files = calloc(list.n ? (size_t)list.n : 1, sizeof(*job.files));
+    if (!job.files)
+        return 1;
+    for (int i = 0; i < list.n; i++)
+    {
+        /* absolute paths, so the index does not depend on the working directory */
+        char *abs = abs_path(list.v[i]);
+        job.files[i].path = abs ? abs : list.v[i];
+        if (abs)
+            free(list.v[i]);
+    }
+    if (index_open(&old, index_path))
+    {
+        job.old = &old;
+        job.old_mask = pow2_at_least((uint64_t)old.hdr->nfiles * 2) - 1;
+        job.old_slots = calloc((size_t)job.old_mask + 1, sizeof(uint32_t));
+        for (uint32_t k = 0; job.old_slots && k < old.hdr->nfiles; k++)
+        {
+            uint32_t hs = hash_str(old.strings + old.files[k].path);
+            while (job.old_slots[hs & job.old_mask])
+                hs++;
+            job.old_slots[hs & job.old_mask] = k + 1;
+        }
+    }
+
+    keep_comments = 0; /* only declarations matter here */
+    pthread_t *tids = calloc((size_t)workers, sizeof(*tids));
+    int started = 0;
+    for (int i = 0; tids && i < workers; i++)
+        if (pthread_create(&tids[started], NULL, scan_worker, &job) == 0)
+            started++;
+    if (started == 0)
+        scan_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    double t_scan = now_sec();
+
+    uint32_t nsyms = 0;
+    int relexed = 0, unreadable = 0;
+    for (int i = 0; i < job.nfiles; i++)
+    {
+        relexed += job.files[i].relexed;
+        unreadable += job.files[i].size < 0;
+    }
+
+    /* the new file list: old entries in their order (rescanned, removed or
+       kept as they are), then the files the old index did not have */
+    uint32_t old_n = job.old ? old.hdr->nfiles : 0;
+    uint32_t scan_mask = pow2_at_least((uint64_t)job.nfiles * 2) - 1;
+    uint32_t *scan_slots = calloc((size_t)scan_mask + 1, sizeof(uint32_t));
+    char *placed = calloc((size_t)job.nfiles + 1, 1);
+    struct ScanFile *out = calloc((size_t)old_n + (size_t)job.nfiles + 1, sizeof(*out));
+    int ok = scan_slots && placed && out, nout = 0, kept = 0, removed = 0;
+    for (int i = 0; ok && i < job.nfiles; i++)
+    {
+        if (scanned_file(scan_slots, scan_mask, job.files, job.files[i].path) >= 0)
+        {
+            placed[i] = 1; /* named twice */
+            continue;
+        }
+        uint32_t hs = hash_str(job.files[i].path);
+        while (scan_slots[hs & scan_mask])
+            hs++;
+        scan_slots[hs & scan_mask] = (uint32_t)i + 1;
+    }
+    for (uint32_t k = 0; ok && k < old_n; k++)
+    {
+        const char *p = old.strings + old.files[k].path;
+        int s = scanned_file(scan_slots, scan_mask, job.files, p);
+        if (s >= 0)
+        {
+            placed[s] = 1;
+            if (job.files[s].size >= 0)
+                out[nout++] = job.files[s];
+            else
+                removed++;
+        }
+        else if (under_dir(&dirs, p))
+            removed++;
+        else
+        {
+            out[nout].kept = &old.files[k];
+            out[nout++].size = old.files[k].size;
+            kept++;
+        }
+    }
+    for (int i = 0; ok && i < job.nfiles; i++)
+        if (!placed[i] && job.files[i].size >= 0)
+            out[nout++] = job.files[i];
+    ok = ok && index_write(index_path, out, nout, job.old, &nsyms);
+    if (job.old)
+        index_close(&old);
+    double t_end = now_sec();
+    if (ok)
+        printf("indexed %d files (%d lexed, %d reused, %d unreadable, %d kept, %d removed), %u symbols: "
+               "scan %.1f ms, write %.1f ms, %d threads\n",
+               nout, relexed, job.nfiles - unreadable - relexed, unreadable, kept, removed, nsyms,
+               (t_scan - t0) * 1e3, (t_end - t_scan) * 1e3, started ? started : 1);
+    else
+        fprintf(stderr, "%sERROR:%s Could not write index %s\n", PASTEL_ERROR1, COL_RESET, index_path);
+    free(scan_slots);
+    free(placed);
+    free(out);
+    for (int i = 0; i < dirs.n; i++)
+        free(dirs.v[i]);
+    free(dirs.v);
+
+    for (int i = 0; i < job.nfiles; i++)
+    {
+        for (int k = 0; k < job.files[i].nsyms; k++)
+            free(job.files[i].syms[k].name);
+        free(job.files[i].syms);
+        free(job.files[i].package);
+        free(job.files[i].path);
+    }
+    free(job.files);
+    free(job.old_slots);
+    free(list.v);
+    return ok ? 0 : 1;
+}
+
+/* --index-query INDEX NAME...: list matching declarations; with --bench N and no
+   names, time N lookups of every symbol name in the index instead */
+static int run_index_query(const char *index_path, char **names, int nnames, int iters)
+{
+    struct ProjectIndex ix;
+    if (!index_open(&ix, index_path))
+    {
+        fprintf(stderr, "%sERROR:%s Could not open index %s\n", PASTEL_ERROR1, COL_RESET, index_path);
+        return 1;
+    }
+    if (iters > 0 && nnames == 0)
+    {
+        uint64_t lookups = 0, hits = 0;
+        double t0 = now_sec();
+        for (int it = 0; it < iters; it++)
+            for (uint32_t k = 0; k < ix.hdr->nsyms; k++, lookups++)
+            {
+                uint32_t pos = 0;
+                hits += index_next(&ix, ix.strings + ix.syms[k].name, &pos) != NULL;
+            }
+        double dt = now_sec() - t0;
+        printf("%llu lookups (%llu hits) in %.1f ms: %.0f lookups/s\n", (unsigned long long)lookups,
+               (unsigned long long)hits, dt * 1e3, lookups / dt);
+    }
+    for (int i = 0; i < nnames; i++)
+    {
+        uint32_t pos = 0;
+        const struct IdxSym *sym;
+        while ((sym = index_next(&ix, names[i], &pos)))
+            printf("%s\t%s\t%s:%d\n", names[i], ix.strings + sym->package,
+                   ix.strings + ix.files[sym->file].path, sym->line);
+    }
+    index_close(&ix);
+    return 0;
+}
+
+/* ---------- Pipelined batch mode (--pipeline) ----------
+   Four stages, one thread each: read (mmap) -> lex -> analyze -> format/write.
+   Stages hand files to each other through bounded lock-free single-producer /
+   single-consumer rings; a fifth ring returns finished files to the reader, so
+   the number of files in flight (and their memory) is fixed. A ring between
+   two stages holds at most half of the files in flight, so a slow stage fills
+   its input and the stage before it waits (backpressure). The report on stderr gives per stage
+   busy time, time starved for input, time blocked on output and the average
+   queue length in front of it; the reader's input is the recycle ring, so a
+   starved reader means the later stages are the bottleneck. */
+
+/* per-file state that moves between threads: a stage points its thread-local
+   tables at it while it works on the file */
+struct FileState
+{
+    char *path;
+    char *text; /* mmap'd source (NULL for an empty file) */
+    size_t len;
+    int failed; /* unreadable: later stages only pass it on */
+    int lang;
+    struct Arena arena; /* owns the tables below; recycled with the state */
+    struct InternSet interned;
+    int *decl_slots;
+    uint32_t decl_mask;
+    struct Symbol *table;
+    struct Decl *decls;
+    struct Error *errors;
+    struct Comment *comments;
+    int tok_count, tok_cap, decl_count, decl_cap, err_count, err_cap, com_count, com_cap;
+};
+
+static void state_attach(const struct FileState *st)
+{
+    arena = st->arena;
+    interned = st->interned;
+    decl_slots = st->decl_slots;
+    decl_mask = st->decl_mask;
+    table = st->table;
+    decls = st->decls;
+    errors = st->errors;
+    comments = st->comments;
+    tok_count = st->tok_count;
+    tok_cap = st->tok_cap;
+    decl_count = st->decl_count;
+    decl_cap = st->decl_cap;
+    err_count = st->err_count;
+    err_cap = st->err_cap;
+    com_count = st->com_count;
+    com_cap = st->com_cap;
+    cur_lang = st->lang;
+}
+
+static void state_detach(struct FileState *st)
+{
+    st->arena = arena;
+    st->interned = interned;
+    st->decl_slots = decl_slots;
+    st->decl_mask = decl_mask;
+    st->table = table;
+    st->decls = decls;
+    st->errors = errors;
+    st->comments = comments;
+    st->tok_count = tok_count;
+    st->tok_cap = tok_cap;
+    st->decl_count = decl_count;
+    st->decl_cap = decl_cap;
+    st->err_count = err_count;
+    st->err_cap = err_cap;
+    st->com_count = com_count;
+    st->com_cap = com_cap;
+    st->lang = cur_lang;
+    memset(&arena, 0, sizeof(arena));
+    reset_tables();
+}
+
+/* Bounded SPSC ring. head is written only by the consumer, tail only by the
+   producer; each side also owns its own counters. */
+struct Ring
+{
+    void **slots;
+    unsigned mask;
+    unsigned head __attribute__((aligned(64)));
+    uint64_t empty_waits; /* consumer found the ring empty */
+    unsigned tail __attribute__((aligned(64)));
+    uint64_t pushes, full_waits, occupancy_sum; /* producer side */
+};
+
+static int ring_init(struct Ring *r, unsigned cap)
+{
+    memset(r, 0, sizeof(*r));
+    r->mask = cap - 1;
+    r->slots = calloc(cap, sizeof(void *));
+    return r->slots != NULL;
+}
+
+/* spin briefly, then yield, then sleep: waiting must not starve the other stages */
+static void ring_backoff(unsigned *spins)
+{
+    if (++*spins < 64)
+        return;
+    if (*spins < 1024)
+        sched_yield();
+    else
+    {
+        struct timespec ts = {0, 50000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* blocks while full; returns the time spent blocked */
+static double ring_push(struct Ring *r, void *item)
+{
+    unsigned tail = r->tail, spins = 0;
+    double t0 = 0;
+    while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+    {
+        if (spins == 0)
+        {
+            r->full_waits++;
+            t0 = now_sec();
+        }
+        ring_backoff(&spins);
+    }
+    r->slots[tail & r->mask] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    r->pushes++;
+    r->occupancy_sum += tail + 1 - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    return spins ? now_sec() - t0 : 0;
+}
+
+/* blocks while empty; returns the time spent blocked */
+static double ring_pop(struct Ring *r, void **item)
+{
+    unsigned head = r->head, spins = 0;
+    double t0 = 0;
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+    {
+        if (spins == 0)
+        {
+            r->empty_waits++;
+            t0 = now_sec();
+        }
+        ring_backoff(&spins);
+    }
+    *item = r->slots[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return spins ? now_sec() - t0 : 0;
+}
+
+enum
+{
+    STAGE_READ,
+    STAGE_LEX,
+    STAGE_ANALYZE,
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+static const char *stage_names[STAGE_COUNT] = {"read", "lex", "analyze", "write"};
+
+struct Pipeline
+{
+    struct Ring rings[STAGE_COUNT + 1]; /* rings[s] feeds stage s; rings[STAGE_COUNT] recycles */
+    char **paths;
+    int npaths;
+    int lang, fmt;
+    int failures;
+    /* per stage, owned by its thread */
+    double busy[STAGE_COUNT], wait_in[STAGE_COUNT], wait_out[STAGE_COUNT];
+    int items[STAGE_COUNT];
+};
+
+struct StageArg
+{
+    struct Pipeline *pl;
+    int stage;
+};
+
+static void pipeline_read(struct FileState *st, const struct Pipeline *pl)
+{
+    if (st->text)
+        munmap(st->text, st->len);
+    st->text = NULL;
+    st->len = 0;
+    st->failed = 1;
+    st->lang = lang_for_file(st->path, pl->lang);
+    int fd = open(st->path, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0)
+    {
+        st->failed = 0;
+        if (sb.st_size > 0)
+        {
+            /* MAP_POPULATE: the I/O happens here, not as page faults in the lexer */
+            void *p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            if (p == MAP_FAILED)
+                st->failed = 1;
+            else
+            {
+                st->text = p;
+                st->len = (size_t)sb.st_size;
+            }
+        }
+    }
+    close(fd);
+}
+
+static void *pipeline_stage(void *arg)
+{
+    struct Pipeline *pl = ((struct StageArg *)arg)->pl;
+    int stage = ((struct StageArg *)arg)->stage;
+    struct Ring *in = &pl->rings[stage], *out = &pl->rings[stage + 1];
+    if (stage == STAGE_WRITE)
+        out = &pl->rings[STAGE_COUNT];
+    int next_path = 0;
+    while (1)
+    {
+        struct FileState *st;
+        if (stage == STAGE_READ)
+        {
+            /* the reader takes empty states back from the writer */
+            if (next_path == pl->npaths)
+            {
+                pl->wait_out[stage] += ring_push(&pl->rings[STAGE_LEX], NULL);
+                break;
+            }
+            pl->wait_in[stage] += ring_pop(&pl->rings[STAGE_COUNT], (void **)&st);
+            out = &pl->rings[STAGE_LEX];
+        }
+        else
+        {
+            pl->wait_in[stage] += ring_pop(in, (void **)&st);
+            if (!st)
+            {
+                if (stage != STAGE_WRITE)
+                    pl->wait_out[stage] += ring_push(out, NULL);
+                break;
+            }
+        }
+
+        double t0 = now_sec();
+        if (stage == STAGE_READ)
+        {
+            st->path = pl->paths[next_path++];
+            pipeline_read(st, pl);
+        }
+        else if (!st->failed)
+        {
+            state_attach(st);
+            if (stage == STAGE_LEX)
+                st->failed = !tokenize_buffer(st->text ? st->text : "", st->len, st->lang);
+            else if (stage == STAGE_ANALYZE)
+                detect_errors_pass2();
+            else
+                print_report(stdout, st->path, pl->fmt);
+            state_detach(st);
+        }
+        if (stage == STAGE_WRITE && st->failed)
+        {
+            fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, st->path);
+            pl->failures++;
+        }
+        pl->busy[stage] += now_sec() - t0;
+        pl->items[stage]++;
+        pl->wait_out[stage] += ring_push(out, st);
+    }
+    return NULL;
+}
+
+/* --pipeline PATH...: analyze files and directory trees through the staged pipeline */
+static int run_pipeline(char **args, int nargs, int lang, int fmt, int depth)
+{
+    struct PathList list = {0};
+    for (int i = 0; i < nargs; i++)
+    {
+        struct stat sb;
+        if (stat(args[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+            walk_tree(args[i], &list);
+        else
+            path_push(&list, args[i]);
+    }
+
+    struct Pipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.paths = list.v;
+    pl.npaths = list.n;
+    pl.lang = lang;
+    pl.fmt = fmt;
+    /* the recycle ring holds every state; a stage ring at most half of them,
+       so a slow stage fills its input and the stage before it blocks */
+    unsigned cap = pow2_at_least((uint64_t)depth + 1), stage_cap = 1;
+    while (stage_cap * 2 <= (unsigned)depth / 2)
+        stage_cap *= 2;
+    struct FileState *states = calloc((size_t)depth, sizeof(*states));
+    int ok = states != NULL;
+    for (int r = 0; ok && r <= STAGE_COUNT; r++)
+        ok = ring_init(&pl.rings[r], r == STAGE_COUNT ? cap : stage_cap);
+    for (int i = 0; ok && i < depth; i++)
+    {
+        ring_push(&pl.rings[STAGE_COUNT], &states[i]);
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "%sERROR:%s out of memory\n", PASTEL_ERROR1, COL_RESET);
+        return 1;
+    }
+    pl.rings[STAGE_COUNT].pushes = pl.rings[STAGE_COUNT].occupancy_sum = 0;
+
+    double t0 = now_sec();
+    pthread_t tids[STAGE_COUNT];
+    struct StageArg sargs[STAGE_COUNT];
+    /* last stage first: if a thread cannot be started, no file has entered
+       the pipeline yet and the stages already running only wait for input */
+    int failed_stage = -1;
+    for (int s = STAGE_COUNT - 1; s >= 0 && failed_stage < 0; s--)
+    {
+        sargs[s].pl = &pl;
+        sargs[s].stage = s;
+        if (pthread_create(&tids[s], NULL, pipeline_stage, &sargs[s]) != 0)
+            failed_stage = s;
+    }
+    if (failed_stage >= 0)
+    {
+        /* end the running stages, then analyze the files one by one */
+        if (failed_stage < STAGE_WRITE)
+            ring_push(&pl.rings[failed_stage + 1], NULL);
+        for (int s = failed_stage + 1; s < STAGE_COUNT; s++)
+            pthread_join(tids[s], NULL);
+        for (int i = 0; i < pl.npaths; i++)
+            if (!analyze_source(pl.paths[i], NULL, 0, lang, fmt, stdout))
+            {
+                fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, pl.paths[i]);
+                pl.failures++;
+            }
+    }
+    for (int s = 0; failed_stage < 0 && s < STAGE_COUNT; s++)
+        pthread_join(tids[s], NULL);
+    double wall = now_sec() - t0;
+    fflush(stdout);
+
+    if (failed_stage >= 0)
+        fprintf(stderr, "pipeline: could not start the stage threads, %d files analyzed one by one in %.1f ms\n",
+                pl.npaths, wall * 1e3);
+    else
+        fprintf(stderr, "pipeline: %d files in %.1f ms, %d in flight, %u per stage queue\n", pl.npaths, wall * 1e3,
+                depth, stage_cap);
+    if (failed_stage < 0)
+        fprintf(stderr, "%-8s %6s %10s %12s %12s %9s %10s %10s\n", "stage", "items", "busy ms",
+                "starved ms", "blocked ms", "in-queue", "empty", "full-out");
+    for (int s = 0; failed_stage < 0 && s < STAGE_COUNT; s++)
+    {
+        const struct Ring *in = &pl.rings[s == STAGE_READ ? STAGE_COUNT : s];
+        const struct Ring *out = &pl.rings[s == STAGE_WRITE ? STAGE_COUNT : s + 1];
+        fprintf(stderr, "%-8s %6d %10.1f %12.1f %12.1f %9.2f %10llu %10llu\n", stage_names[s], pl.items[s],
+                pl.busy[s] * 1e3, pl.wait_in[s] * 1e3, pl.wait_out[s] * 1e3,
+                in->pushes ? (double)in->occupancy_sum / in->pushes : 0.0,
+                (unsigned long long)in->empty_waits, (unsigned long long)out->full_waits);
+    }
+
+    for (int i = 0; i < depth; i++)
+    {
+        if (states[i].text)
+            munmap(states[i].text, states[i].len);
+        arena_free(&states[i].arena);
+    }
+    for (int r = 0; r <= STAGE_COUNT; r++)
+        free(pl.rings[r].slots);
+    for (int i = 0; i < list.n; i++)
+        free(list.v[i]);
+    free(list.v);
+    free(states);
+    return pl.failures ? 1 : 0;
+}
+
+/* ---------- Token-level diff (--diff OLD NEW) ----------
+   Each line is reduced to a hash of its token sequence (kind + text), so
+   layout, whitespace and comment edits disappear. A patience pass anchors on
+   lines that occur exactly once on both sides and recurses between anchors;
+   what is left between anchors is a hunk, diffed token by token with an exact
+   LCS when it is small enough and reported as a block replacement otherwise.
+   Output: one record per changed token, "-" old / "+" new, with its line. */
+
+#define DIFF_LCS_MAX 4000000 /* cells of the per-hunk LCS table */
+
+struct DiffTok
+{
+    const char *text;
+    uint32_t hash;
+    int kind, line;
+};
+struct DiffLine
+{
+    uint64_t hash; /* of the whole token sequence */
+    int first;     /* first token; the line ends where the next one starts */
+};
+struct DiffSide
+{
+    struct FileState st; /* its arena owns the token texts */
+    struct DiffTok *tok;
+    int ntok;
+    struct DiffLine *lines;
+    int nlines;
+};
+struct DiffSlot
+{
+    uint64_t hash;
+    unsigned gen; /* slot is empty unless it matches the current range's gen */
+    int na, nb;   /* occurrences in the current range */
+    int pb;       /* new-side line of the last occurrence */
+};
+struct Diff
+{
+    const struct DiffSide *a, *b;
+    FILE *out; /* NULL: only count (--bench) */
+    struct DiffSlot *map;
+    uint32_t mask;
+    unsigned gen;
+    unsigned short *lcs;
+    int hunks, removed, added;
+};
+
+/* lex one side and keep its tokens grouped by line */
+static int diff_load(struct DiffSide *d, const char *path, int lang)
+{
+    size_t len;
+    const char *text = load_file(path, &len);
+    if (!text || !tokenize_buffer(text, len, lang_for_file(path, lang)))
+        return 0;
+    d->tok = malloc(((size_t)tok_count + 1) * sizeof(*d->tok));
+    d->lines = malloc(((size_t)tok_count + 1) * sizeof(*d->lines));
+    if (!d->tok || !d->lines)
+        return 0;
+    d->ntok = tok_count;
+    d->nlines = 0;
+    for (int i = 0; i < tok_count; i++)
+    {
+        uint32_t h = hash_str(table[i].token) ^ ((uint32_t)table[i].attribute * 0x9e3779b1u);
+        d->tok[i] = (struct DiffTok){table[i].token, h, table[i].attribute, table[i].line};
+        if (i == 0 || table[i].line != table[i - 1].line)
+            d->lines[d->nlines++] = (struct DiffLine){1469598103934665603ULL, i};
+        struct DiffLine *l = &d->lines[d->nlines - 1];
+        l->hash = (l->hash ^ h) * 1099511628211ULL;
+    }
+    d->lines[d->nlines].first = tok_count; /* sentinel: end of the last line */
+    state_detach(&d->st);
+    return 1;
+}
+
+static void diff_free(struct DiffSide *d)
+{
+    free(d->tok);
+    free(d->lines);
+    arena_free(&d->st.arena);
+}
+
+static int tok_equal(const struct DiffTok *x, const struct DiffTok *y)
+{
+    return x->hash == y->hash && x->kind == y->kind && strcmp(x->text, y->text) == 0;
+}
+
+static void diff_emit(struct Diff *d, char op, const struct DiffTok *t)
+{
+    if (op == '-')
+        d->removed++;
+    else
+        d->added++;
+    if (!d->out)
+        return;
+    fprintf(d->out, "%c\t%d\t%s\t", op, t->line, attrLabel(t->kind));
+    put_escaped(d->out, t->text, strlen(t->text));
+    putc('\n', d->out);
+}
+
+/* line number where token t sits, or just past the end of the file */
+static int diff_line_at(const struct DiffSide *s, int t)
+{
+    if (t < s->ntok)
+        return s->tok[t].line;
+    return s->ntok ? s->tok[s->ntok - 1].line + 1 : 1;
+}
+
+/* old lines [a0,a1) were replaced by new lines [b0,b1): diff their tokens */
+static void diff_hunk(struct Diff *d, int a0, int a1, int b0, int b1)
+{
+    const struct DiffTok *x = d->a->tok + d->a->lines[a0].first;
+    const struct DiffTok *y = d->b->tok + d->b->lines[b0].first;
+    int n = d->a->lines[a1].first - d->a->lines[a0].first;
+    int m = d->b->lines[b1].first - d->b->lines[b0].first;
+    d->hunks++;
+    if (d->out)
+        fprintf(d->out, "@\t%d\t%d\n", diff_line_at(d->a, (int)(x - d->a->tok)), diff_line_at(d->b, (int)(y - d->b->tok)));
+
+    /* a changed line usually differs in a token or two: trim the common ends */
+    while (n > 0 && m > 0 && tok_equal(x, y))
+        x++, y++, n--, m--;
+    int tail = 0;
+    while (tail < n && tail < m && tok_equal(&x[n - 1 - tail], &y[m - 1 - tail]))
+        tail++;
+    n -= tail;
+    m -= tail;
+
+    size_t cells = (size_t)(n + 1) * (size_t)(m + 1);
+    if (n == 0 || m == 0 || cells > DIFF_LCS_MAX)
+    {
+        for (int i = 0; i < n; i++)
+            diff_emit(d, '-', &x[i]);
+        for (int j = 0; j < m; j++)
+            diff_emit(d, '+', &y[j]);
+        return;
+    }
+    /* L[i][j] = LCS of x[i..n) and y[j..m) */
+    unsigned short *L = d->lcs;
+    size_t w = (size_t)m + 1;
+    for (int j = 0; j <= m; j++)
+        L[(size_t)n * w + j] = 0;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        L[(size_t)i * w + m] = 0;
+        for (int j = m - 1; j >= 0; j--)
+        {
+            unsigned short down = L[(size_t)(i + 1) * w + j], right = L[(size_t)i * w + j + 1];
+            L[(size_t)i * w + j] = tok_equal(&x[i], &y[j]) ? L[(size_t)(i + 1) * w + j + 1] + 1 : (down > right ? down : right);
+        }
+    }
+    int i = 0, j = 0;
+    while (i < n && j < m)
+    {
+        if (tok_equal(&x[i], &y[j]))
+            i++, j++;
+        else if (L[(size_t)(i + 1) * w + j] >= L[(size_t)i * w + j + 1])
+            diff_emit(d, '-', &x[i++]);
+        else
+            diff_emit(d, '+', &y[j++]);
+    }
+    for (; i < n; i++)
+        diff_emit(d, '-', &x[i]);
+    for (; j < m; j++)
+        diff_emit(d, '+', &y[j]);
+}
+
+static struct DiffSlot *diff_slot(struct Diff *d, uint64_t hash)
+{
+    uint32_t k = (uint32_t)(hash ^ (hash >> 32)) & d->mask;
+    while (d->map[k].gen == d->gen && d->map[k].hash != hash)
+        k = (k + 1) & d->mask;
+    struct DiffSlot *s = &d->map[k];
+    if (s->gen != d->gen)
+        *s = (struct DiffSlot){hash, d->gen, 0, 0, 0};
+    return s;
+}
+
+/* Anchors for old lines [a0,a1) vs new lines [b0,b1): lines unique on both
+   sides, cut down to the longest run that is increasing on both (patience
+   sorting). Fills pa/pb in order and returns how many there are. */
+static int diff_anchors(struct Diff *d, int a0, int a1, int b0, int b1, int *pa, int *pb)
+{
+    const struct DiffLine *A = d->a->lines, *B = d->b->lines;
+    d->gen++; /* empties the map */
+    for (int i = a0; i < a1; i++)
+        diff_slot(d, A[i].hash)->na++;
+    for (int j = b0; j < b1; j++)
+    {
+        struct DiffSlot *s = diff_slot(d, B[j].hash);
+        s->nb++;
+        s->pb = j;
+    }
+    int c = 0;
+    for (int i = a0; i < a1; i++)
+    {
+        const struct DiffSlot *s = diff_slot(d, A[i].hash);
+        if (s->na == 1 && s->nb == 1)
+            pa[c] = i, pb[c] = s->pb, c++;
+    }
+    if (c == 0)
+        return 0;
+
+    /* longest increasing subsequence of pb: tops[k] ends the best run of length k+1 */
+    int *tops = malloc((size_t)c * sizeof(int)), *prev = malloc((size_t)c * sizeof(int));
+    if (!tops || !prev)
+    {
+        free(tops), free(prev);
+        return 0;
+    }
+    int piles = 0;
+    for (int k = 0; k < c; k++)
+    {
+        int lo = 0, hi = piles;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (pb[tops[mid]] < pb[k])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        prev[k] = lo ? tops[lo - 1] : -1;
+        tops[lo] = k;
+        if (lo == piles)
+            piles++;
+    }
+    int k = tops[piles - 1];
+    for (int r = piles - 1; r >= 0; r--, k = prev[k])
+        tops[r] = k;
+    for (int r = 0; r < piles; r++)
+        pa[r] = pa[tops[r]], pb[r] = pb[tops[r]];
+    free(tops);
+    free(prev);
+    return piles;
+}
+
+static void diff_range(struct Diff *d, int a0, int a1, int b0, int b1)
+{
+    const struct DiffLine *A = d->a->lines, *B = d->b->lines;
+    while (a0 < a1 && b0 < b1 && A[a0].hash == B[b0].hash)
+        a0++, b0++;
+    while (a0 < a1 && b0 < b1 && A[a1 - 1].hash == B[b1 - 1].hash)
+        a1--, b1--;
+    if (a0 == a1 && b0 == b1)
+        return;
+    int n = 0, *pa = NULL, *pb = NULL;
+    if (a0 < a1 && b0 < b1)
+    {
+        pa = malloc((size_t)(a1 - a0) * sizeof(int));
+        pb = malloc((size_t)(a1 - a0) * sizeof(int));
+        if (pa && pb)
+            n = diff_anchors(d, a0, a1, b0, b1, pa, pb);
+    }
+    if (n == 0)
+        diff_hunk(d, a0, a1, b0, b1);
+    for (int k = 0; k < n; k++)
+    {
+        diff_range(d, a0, pa[k], b0, pb[k]);
+        a0 = pa[k] + 1;
+        b0 = pb[k] + 1;
+    }
+    free(pa);
+    free(pb);
+    if (n)
+        diff_range(d, a0, a1, b0, b1);
+}
+
+static int diff_run(struct Diff *d, const struct DiffSide *a, const struct DiffSide *b, FILE *out)
+{
+    memset(d, 0, sizeof(*d));
+    d->a = a;
+    d->b = b;
+    d->out = out;
+    d->mask = pow2_at_least(2 * ((uint64_t)a->nlines + b->nlines) + 2) - 1;
+    d->map = calloc((size_t)d->mask + 1, sizeof(*d->map));
+    d->lcs = malloc(DIFF_LCS_MAX * sizeof(*d->lcs));
+    if (!d->map || !d->lcs)
+    {
+        free(d->map), free(d->lcs);
+        return 0;
+    }
+    diff_range(d, 0, a->nlines, 0, b->nlines);
+    free(d->map);
+    free(d->lcs);
+    return 1;
+}
+
+/* Baseline for --bench: Myers' O(ND) edit distance over the whole token
+   sequences, with no line anchoring (distance only, no edit script). */
+static long diff_naive(const struct DiffSide *a, const struct DiffSide *b)
+{
+    long n = a->ntok, m = b->ntok, max = n + m;
+    long *v = malloc((size_t)(2 * max + 3) * sizeof(long));
+    if (!v)
+        return -1;
+    long *V = v + max + 1;
+    V[1] = 0;
+    for (long dist = 0; dist <= max; dist++)
+        for (long k = -dist; k <= dist; k += 2)
+        {
+            long x = (k == -dist || (k != dist && V[k - 1] < V[k + 1])) ? V[k + 1] : V[k - 1] + 1;
+            long y = x - k;
+            while (x < n && y < m && tok_equal(&a->tok[x], &b->tok[y]))
+                x++, y++;
+            V[k] = x;
+            if (x >= n && y >= m)
+            {
+                free(v);
+                return dist;
+            }
+        }
+    free(v);
+    return -1;
+}
+
+static int run_diff(const char *old_path, const char *new_path, int lang, int iters)
+{
+    struct DiffSide a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    keep_comments = 0; /* only tokens are compared */
+    double t0 = now_sec();
+    int ok = diff_load(&a, old_path, lang) && diff_load(&b, new_path, lang);
+    double lex = now_sec() - t0;
+    struct Diff d;
+    if (!ok)
+        fprintf(stderr, "%sERROR:%s Could not read %s or %s\n", PASTEL_ERROR1, COL_RESET, old_path, new_path);
+    else if (!iters)
+    {
+        ok = diff_run(&d, &a, &b, stdout);
+        if (ok)
+            printf("S\t%s\t%s\thunks=%d\tremoved=%d\tadded=%d\n", old_path, new_path, d.hunks, d.removed, d.added);
+    }
+    else
+    {
+        t0 = now_sec();
+        for (int it = 0; ok && it < iters; it++)
+            ok = diff_run(&d, &a, &b, NULL);
+        double anchored = (now_sec() - t0) / iters;
+        t0 = now_sec();
+        long dist = diff_naive(&a, &b);
+        double naive = now_sec() - t0;
+        printf("lex both: %.1f ms (%d + %d tokens, %d + %d lines)\n", lex * 1e3, a.ntok, b.ntok, a.nlines, b.nlines);
+        printf("anchored: %.2f ms  hunks=%d removed=%d added=%d\n", anchored * 1e3, d.hunks, d.removed, d.added);
+        printf("naive:    %.2f ms  token edit distance %ld (Myers, whole file)\n", naive * 1e3, dist);
+    }
+    diff_free(&a);
+    diff_free(&b);
+    return ok ? 0 : 1;
+}
+
+/* ---------- Clone detection (--clones PATH...) ----------
+   Identifiers, literals and package names are reduced to their kind, every
+   other token to kind + text, so a copy with renamed variables still matches.
+   Every window of K tokens gets a rolling hash, and winnowing keeps the
+   rightmost minimum of each W consecutive hashes: two files sharing a run of
+   K + W - 1 tokens are guaranteed a common fingerprint. Files are fingerprinted
+   in parallel, the inverted index is built shard by shard (hash prefix) on all
+   threads, and matches on the same diagonal are merged into line ranges.
+   Memory is bounded by sampling: once a worker's share of --budget is full,
+   only hashes whose low bits are zero are kept, first 1/2, then 1/4 ... The
+   choice depends on the hash alone, so both copies of a clone keep the same
+   fingerprints and long clones survive. */
+
+#define CLONE_SHARDS 64
+#define CLONE_MAX_POSTINGS 32 /* a hash seen more often is boilerplate, not a clone */
+#define CLONE_MAX_SAMPLE 63   /* sampling keeps at least 1 in 2^63 hashes (the shifts stay defined) */
+
+struct Fingerprint
+{
+    uint64_t hash;
+    uint32_t file, pos; /* first token of the window */
+    int line, end_line;
+};
+struct ClonePair
+{
+    uint32_t fa, fb;
+    int32_t diag; /* pb - pa: consecutive matches of one clone share it */
+    uint32_t pa;
+    int la, ea, lb, eb;
+};
+/* merged matches: token ranges [ta0,ta1) and [tb0,tb1) plus their lines */
+struct CloneRegion
+{
+    uint32_t fa, fb;
+    uint32_t ta0, ta1, tb0, tb1;
+    int la, ea, lb, eb;
+};
+struct CloneJob;
+struct CloneWorker
+{
+    struct CloneJob *job;
+    struct Fingerprint *fps;
+    size_t nfps, fps_cap;
+    size_t shard_start[CLONE_SHARDS + 1]; /* fps grouped by shard after the prep phase */
+    struct ClonePair *pairs;
+    size_t npairs, pairs_cap;
+    uint64_t tokens, selected;
+};
+struct CloneJob
+{
+    char **paths;
+    int nfiles;
+    int next;        /* next file / shard to claim (atomic) */
+    int k, w;
+    uint32_t min_tokens; /* shorter clones are not reported */
+    size_t budget;       /* fingerprints per worker */
+    unsigned sample; /* low hash bits that must be zero (atomic, only grows) */
+    struct CloneWorker *workers;
+    int nworkers;
+};
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t clone_code(const struct Symbol *t)
+{
+    int a = t->attribute;
+    if (a == 2 || a == 3 || a == 6 || a == 7 || a == 8)
+        return (uint64_t)a * 0x9e3779b97f4a7c15ULL;
+    return (uint64_t)hash_str(t->token) * 31 + (uint64_t)a;
+}
+
+/* drop what the current sampling rate no longer keeps */
+static void clone_compact(struct CloneWorker *w, unsigned sample)
+{
+    uint64_t mask = (1ULL << sample) - 1;
+    size_t n = 0;
+    for (size_t i = 0; i < w->nfps; i++)
+        if ((w->fps[i].hash & mask) == 0)
+            w->fps[n++] = w->fps[i];
+    w->nfps = n;
+}
+
+static void clone_keep(struct CloneWorker *w, uint64_t hash, uint32_t file, int pos, int k)
+{
+    struct CloneJob *job = w->job;
+    w->selected++;
+    unsigned sample = __atomic_load_n(&job->sample, __ATOMIC_RELAXED);
+    if (hash & ((1ULL << sample) - 1))
+        return;
+    while (w->nfps >= job->budget)
+    {
+        /* budget full: halve the sampling rate for everyone; at the lowest rate
+           (only hashes with 63 zero low bits left) further ones are dropped */
+        if (sample >= CLONE_MAX_SAMPLE)
+            return;
+        unsigned seen = sample;
+        if (!__atomic_compare_exchange_n(&job->sample, &seen, sample + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            sample = seen; /* somebody else raised it already */
+        else
+            sample++;
+        clone_compact(w, sample);
+        if (hash & ((1ULL << sample) - 1))
+            return;
+    }
+    if (w->nfps == w->fps_cap)
+    {
+        size_t cap = w->fps_cap ? w->fps_cap * 2 : 4096;
+        if (cap > job->budget)
+            cap = job->budget;
+        struct Fingerprint *grown = realloc(w->fps, cap * sizeof(*grown));
+        if (!grown)
+            return;
+        w->fps = grown;
+        w->fps_cap = cap;
+    }
+    w->fps[w->nfps++] = (struct Fingerprint){hash, file, (uint32_t)pos, table[pos].line, table[pos + k - 1].line};
+}
+
+static __thread uint64_t *clone_codes, *clone_grams;
+static __thread size_t clone_scratch;
+
+static void clone_file(struct CloneWorker *w, uint32_t file)
+{
+    const struct CloneJob *job = w->job;
+    size_t len;
+    const char *text = load_file(job->paths[file], &len);
+    if (!text || !tokenize_buffer(text, len, lang_for_file(job->paths[file], LANG_AUTO)))
+        return;
+    w->tokens += (uint64_t)tok_count;
+    int k = job->k, win = job->w, n = tok_count - k + 1; /* n windows */
+    if (n <= 0)
+        return;
+    if ((size_t)tok_count > clone_scratch)
+    {
+        free(clone_codes);
+        free(clone_grams);
+        clone_scratch = (size_t)tok_count * 2;
+        clone_codes = malloc(clone_scratch * sizeof(uint64_t));
+        clone_grams = malloc(clone_scratch * sizeof(uint64_t));
+        if (!clone_codes || !clone_grams)
+        {
+            clone_scratch = 0;
+            return;
+        }
+    }
+    /* polynomial rolling hash over the token codes, base B mod 2^64 */
+    const uint64_t B = 1000003;
+    uint64_t top = 1, h = 0; /* top = B^(k-1) */
+    for (int i = 1; i < k; i++)
+        top *= B;
+    for (int i = 0; i < tok_count; i++)
+    {
+        clone_codes[i] = clone_code(&table[i]);
+        if (i >= k)
+            h -= clone_codes[i - k] * top;
+        h = h * B + clone_codes[i];
+        if (i >= k - 1)
+            clone_grams[i - k + 1] = mix64(h);
+    }
+    /* winnowing: rightmost minimum of every window of win hashes, once each */
+    int last = -1;
+    for (int end = (n < win ? n : win) - 1; end < n; end++)
+    {
+        int m = end;
+        for (int j = end - 1; j >= 0 && j > end - win; j--)
+            if (clone_grams[j] < clone_grams[m])
+                m = j;
+        if (m != last)
+            clone_keep(w, clone_grams[m], file, m, k);
+        last = m;
+    }
+}
+
+static void *clone_scan_worker(void *arg)
+{
+    struct CloneWorker *w = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&w->job->next, 1, __ATOMIC_RELAXED)) < w->job->nfiles)
+        clone_file(w, (uint32_t)i);
+    return NULL;
+}
+
+/* apply the final sampling rate, then group the fingerprints by shard */
+static void *clone_prep_worker(void *arg)
+{
+    struct CloneWorker *w = arg;
+    clone_compact(w, w->job->sample);
+    size_t count[CLONE_SHARDS] = {0};
+    for (size_t i = 0; i < w->nfps; i++)
+        count[w->fps[i].hash >> 58]++;
+    w->shard_start[0] = 0;
+    for (int s = 0; s < CLONE_SHARDS; s++)
+        w->shard_start[s + 1] = w->shard_start[s] + count[s];
+    struct Fingerprint *sorted = malloc((w->nfps ? w->nfps : 1) * sizeof(*sorted));
+    if (!sorted)
+    {
+        w->nfps = 0;
+        memset(w->shard_start, 0, sizeof(w->shard_start));
+        return NULL;
+    }
+    size_t at[CLONE_SHARDS];
+    memcpy(at, w->shard_start, sizeof(at));
+    for (size_t i = 0; i < w->nfps; i++)
+        sorted[at[w->fps[i].hash >> 58]++] = w->fps[i];
+    free(w->fps);
+    w->fps = sorted;
+    return NULL;
+}
+
+static int cmp_fingerprint(const void *a, const void *b)
+{
+    const struct Fingerprint *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->file != y->file)
+        return x->file < y->file ? -1 : 1;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static void clone_pair(struct CloneWorker *w, const struct Fingerprint *a, const struct Fingerprint *b)
+{
+    if (a->file == b->file && b->pos - a->pos < (uint32_t)w->job->k)
+        return; /* overlaps itself (a repeated token run) */
+    if (w->npairs == w->pairs_cap)
+    {
+        size_t cap = w->pairs_cap ? w->pairs_cap * 2 : 4096;
+        struct ClonePair *grown = realloc(w->pairs, cap * sizeof(*grown));
+        if (!grown)
+            return;
+        w->pairs = grown;
+        w->pairs_cap = cap;
+    }
+    w->pairs[w->npairs++] = (struct ClonePair){a->file, b->file, (int32_t)(b->pos - a->pos), a->pos,
+                                               a->line, a->end_line, b->line, b->end_line};
+}
+
+/* inverted index, one shard at a time: sort by hash and pair up each posting list */
+static void *clone_shard_worker(void *arg)
+{
+    struct CloneWorker *w = arg;
+    const struct CloneJob *job = w->job;
+    int s;
+    while ((s = __atomic_fetch_add(&w->job->next, 1, __ATOMIC_RELAXED)) < CLONE_SHARDS)
+    {
+        size_t n = 0;
+        for (int t = 0; t < job->nworkers; t++)
+            n += job->workers[t].shard_start[s + 1] - job->workers[t].shard_start[s];
+        struct Fingerprint *v = malloc((n ? n : 1) * sizeof(*v));
+        if (!v)
+            continue;
+        n = 0;
+        for (int t = 0; t < job->nworkers; t++)
+        {
+            const struct CloneWorker *o = &job->workers[t];
+            size_t cnt = o->shard_start[s + 1] - o->shard_start[s];
+            memcpy(v + n, o->fps + o->shard_start[s], cnt * sizeof(*v));
+            n += cnt;
+        }
+        qsort(v, n, sizeof(*v), cmp_fingerprint);
+        for (size_t i = 0, j; i < n; i = j)
+        {
+            for (j = i + 1; j < n && v[j].hash == v[i].hash; j++)
+                ;
+            if (j - i < 2 || j - i > CLONE_MAX_POSTINGS)
+                continue;
+            for (size_t a = i; a < j; a++)
+                for (size_t b = a + 1; b < j; b++)
+                    clone_pair(w, &v[a], &v[b]);
+        }
+        free(v);
+    }
+    return NULL;
+}
+
+static int cmp_clone_pair(const void *a, const void *b)
+{
+    const struct ClonePair *x = a, *y = b;
+    if (x->fa != y->fa)
+        return x->fa < y->fa ? -1 : 1;
+    if (x->fb != y->fb)
+        return x->fb < y->fb ? -1 : 1;
+    if (x->diag != y->diag)
+        return x->diag < y->diag ? -1 : 1;
+    return (x->pa > y->pa) - (x->pa < y->pa);
+}
+
+static int cmp_clone_region(const void *a, const void *b)
+{
+    const struct CloneRegion *x = a, *y = b;
+    if (x->fa != y->fa)
+        return x->fa < y->fa ? -1 : 1;
+    if (x->fb != y->fb)
+        return x->fb < y->fb ? -1 : 1;
+    if (x->ta0 != y->ta0)
+        return x->ta0 < y->ta0 ? -1 : 1;
+    return (x->ta1 < y->ta1) - (x->ta1 > y->ta1); /* longest first */
+}
+
+/* run one phase on every worker; returns the number of threads that ran it */
+static int clone_phase(struct CloneJob *job, void *(*fn)(void *))
+{
+    pthread_t *tids = calloc((size_t)job->nworkers, sizeof(*tids));
+    int started = 0;
+    job->next = 0;
+    for (int i = 0; tids && i < job->nworkers; i++)
+        if (pthread_create(&tids[started], NULL, fn, &job->workers[i]) == 0)
+            started++;
+    if (started == 0)
+        for (int i = 0; i < job->nworkers; i++)
+            fn(&job->workers[i]);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return started ? started : 1;
+}
+
+/* Output: P, file A, first line, last line, file B, first line, last line, tokens */
+static int run_clones(char **paths, int npaths, int workers, int k, int w, int min_tokens, size_t budget)
+{
+    double t0 = now_sec();
+    struct PathList list = {0};
+    for (int i = 0; i < npaths; i++)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode))
+            walk_tree(paths[i], &list);
+        else
+            path_push(&list, paths[i]);
+    }
+    struct CloneJob job;
+    memset(&job, 0, sizeof(job));
+    job.paths = list.v;
+    job.nfiles = list.n;
+    job.k = k;
+    job.w = w;
+    job.min_tokens = (uint32_t)min_tokens;
+    job.nworkers = workers;
+    job.budget = budget / (size_t)workers + 1;
+    job.workers = calloc((size_t)workers, sizeof(*job.workers));
+    if (!job.workers)
+        return 1;
+    for (int i = 0; i < workers; i++)
+        job.workers[i].job = &job;
+
+    keep_comments = 0;
+    int threads = clone_phase(&job, clone_scan_worker);
+    double t_scan = now_sec();
+    clone_phase(&job, clone_prep_worker);
+    clone_phase(&job, clone_shard_worker);
+    double t_index = now_sec();
+
+    size_t npairs = 0, nfps = 0;
+    uint64_t tokens = 0, selected = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        npairs += job.workers[i].npairs;
+        nfps += job.workers[i].nfps;
+        tokens += job.workers[i].tokens;
+        selected += job.workers[i].selected;
+    }
+    struct ClonePair *pairs = malloc((npairs ? npairs : 1) * sizeof(*pairs));
+    if (!pairs)
+        return 1;
+    npairs = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        if (job.workers[i].npairs)
+            memcpy(pairs + npairs, job.workers[i].pairs, job.workers[i].npairs * sizeof(*pairs));
+        npairs += job.workers[i].npairs;
+    }
+    qsort(pairs, npairs, sizeof(*pairs), cmp_clone_pair);
+
+    /* merge matches on one diagonal of one file pair across gaps left by sampling
+       and by dropped boilerplate hashes (a chance match on the same diagonal is rare) */
+    uint32_t gap = job.sample < 16 ? (uint32_t)(4 * (k + w)) << job.sample : UINT32_MAX;
+    struct CloneRegion *regions = malloc((npairs ? npairs : 1) * sizeof(*regions));
+    if (!regions)
+        return 1;
+    size_t nregions = 0;
+    for (size_t i = 0, j; i < npairs; i = j)
+    {
+        const struct ClonePair *p = &pairs[i];
+        struct CloneRegion r = {p->fa, p->fb, p->pa, p->pa + (uint32_t)k, p->pa + (uint32_t)p->diag,
+                                p->pa + (uint32_t)p->diag + (uint32_t)k, p->la, p->ea, p->lb, p->eb};
+        for (j = i + 1; j < npairs && pairs[j].fa == p->fa && pairs[j].fb == p->fb && pairs[j].diag == p->diag &&
+                        pairs[j].pa + (uint32_t)k - r.ta1 <= gap;
+             j++)
+        {
+            r.ta1 = pairs[j].pa + (uint32_t)k;
+            r.tb1 = r.ta1 + (uint32_t)p->diag;
+            r.ea = pairs[j].ea > r.ea ? pairs[j].ea : r.ea;
+            r.eb = pairs[j].eb > r.eb ? pairs[j].eb : r.eb;
+        }
+        regions[nregions++] = r;
+    }
+    /* repetitive code matches on several nearby diagonals: fold regions
+       overlapping on both sides into the first one (ta1 = 0 marks folded) */
+    qsort(regions, nregions, sizeof(*regions), cmp_clone_region);
+    int clones = 0;
+    for (size_t i = 0; i < nregions; i++)
+    {
+        struct CloneRegion r = regions[i];
+        if (r.ta1 == 0)
+            continue;
+        for (size_t j = i + 1; j < nregions && regions[j].fa == r.fa && regions[j].fb == r.fb && regions[j].ta0 < r.ta1; j++)
+        {
+            struct CloneRegion *o = &regions[j];
+            if (o->ta1 == 0 || o->tb0 >= r.tb1 || o->tb1 <= r.tb0)
+                continue;
+            r.ta1 = o->ta1 > r.ta1 ? o->ta1 : r.ta1;
+            r.tb0 = o->tb0 < r.tb0 ? o->tb0 : r.tb0;
+            r.tb1 = o->tb1 > r.tb1 ? o->tb1 : r.tb1;
+            r.ea = o->ea > r.ea ? o->ea : r.ea;
+            r.lb = o->lb < r.lb ? o->lb : r.lb;
+            r.eb = o->eb > r.eb ? o->eb : r.eb;
+            o->ta1 = 0;
+        }
+        if ((r.fa == r.fb && r.tb0 < r.ta1) || r.ta1 - r.ta0 < job.min_tokens)
+            continue; /* too short, or a run repeating itself rather than a copy */
+        printf("P\t%s\t%d\t%d\t%s\t%d\t%d\t%u\n", list.v[r.fa], r.la, r.ea, list.v[r.fb], r.lb, r.eb, r.ta1 - r.ta0);
+        clones++;
+    }
+    free(regions);
+    double t_end = now_sec();
+    fflush(stdout);
+    fprintf(stderr, "clones: %d files, %llu tokens, %llu fingerprints selected, %zu kept (sample 1/%llu), "
+                    "%zu matches, %d clones\n",
+            list.n, (unsigned long long)tokens, (unsigned long long)selected, nfps, 1ULL << job.sample, npairs, clones);
+    fprintf(stderr, "clones: fingerprint %.1f ms, index %.1f ms, merge %.1f ms, %d threads, %.1f MB fingerprints\n",
+            (t_scan - t0) * 1e3, (t_index - t_scan) * 1e3, (t_end - t_index) * 1e3, threads,
+            nfps * sizeof(struct Fingerprint) / 1e6);
+
+    for (int i = 0; i < workers; i++)
+    {
+        free(job.workers[i].fps);
+        free(job.workers[i].pairs);
+    }
+    free(job.workers);
+    free(pairs);
+    for (int i = 0; i < list.n; i++)
+        free(list.v[i]);
+    free(list.v);
+    return 0;
+}
+
+/* ---------- Token-aware search (--find PATTERN PATH...) ----------
+   PATTERN is a sequence of terms matched against consecutive tokens, each
+   KIND, KIND:text or text (any kind), e.g. "IDENTIFIER:count" or
+   "KEYWORD:when IDENTIFIER". The longest literal text is the prefilter: files
+   without a raw occurrence are skipped after a SIMD substring scan. For the
+   rest a byte-level state scan discards hits that are not in code: it jumps
+   over plain code with SIMD and reads comments, strings, char literals and
+   package/import lines with the lexer's own lex_span and lex_namespace.
+   Only a few lines around each remaining hit are lexed, starting from a
+   point where the lexer is known to be in code. */
+
+#define FIND_MAX_TERMS 16
+
+struct FindTerm
+{
+    int kind; /* 0: any kind */
+    const char *text; /* NULL: any text */
+};
+struct FindJob
+{
+    char **paths;
+    int nfiles;
+    int next; /* next file to claim (atomic) */
+    struct FindTerm terms[FIND_MAX_TERMS];
+    int nterms;
+    const char *lit; /* prefilter literal, NULL when no term has text */
+    size_t lit_len;
+    int lit_word_end, lit_word_start; /* literal ends / starts with an identifier character */
+    int lang;
+    /* totals (atomic) */
+    uint64_t bytes, hit_files, regions, lexed, matches;
+};
+
+/* position of the first occurrence of needle in hay[0..n) or NULL. SSE2
+   compares the first and last needle byte at 16 positions at once and only
+   checks the middle where both agree. */
+static const char *find_literal(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m == 0 || m > n)
+        return NULL;
+    if (m == 1)
+        return memchr(hay, needle[0], n);
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(hay + i, n - i, needle, m);
+}
+
+static int is_ident_char(int c)
+{
+    return isalnum(c) || c == '_';
+}
+
+/* bytes the code state has to stop at: newline, comment start, quotes,
+   package / import */
+static unsigned char scan_stop[256];
+
+static void scan_stop_init(void)
+{
+    scan_stop['\n'] = scan_stop['"'] = scan_stop['/'] = scan_stop['\''] = 1;
+    scan_stop['p'] = scan_stop['i'] = 1;
+}
+
+/* first offset in [i, upto) the code state must look at, or upto */
+static size_t scan_skip_code(const char *p, size_t i, size_t upto)
+{
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n'), sl = _mm_set1_epi8('/'), dq = _mm_set1_epi8('"');
+    const __m128i sq = _mm_set1_epi8('\''), lp = _mm_set1_epi8('p'), li = _mm_set1_epi8('i');
+    for (; i + 16 <= upto; i += 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, nl), _mm_cmpeq_epi8(b, sl)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(b, dq), _mm_cmpeq_epi8(b, sq)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(b, lp), _mm_cmpeq_epi8(b, li)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask);
+    }
+#endif
+    while (i < upto && !scan_stop[(unsigned char)p[i]])
+        i++;
+    return i;
+}
+
+/* lexer state scan: code, or stopped at a hit inside a namespace name */
+enum
+{
+    FS_CODE,
+    FS_NAMESPACE
+};
+#define FIND_RING 8
+struct FindScan
+{
+    const char *p;
+    size_t len, pos;
+    int state, line, lang;
+    size_t after_char; /* end of the last char literal: a token starts there */
+    size_t ns_end; /* FS_NAMESPACE: where the namespace name ends, on line ns_line */
+    int ns_line;
+    /* recent points where lexing can restart: line starts in code, ends of
+       comments / strings / namespaces */
+    size_t clean_pos[FIND_RING];
+    int clean_line[FIND_RING];
+    unsigned nclean;
+};
+
+static void scan_clean_at(struct FindScan *s, size_t pos)
+{
+    s->clean_pos[s->nclean % FIND_RING] = pos;
+    s->clean_line[s->nclean % FIND_RING] = s->line;
+    s->nclean++;
+}
+
+static void scan_clean(struct FindScan *s)
+{
+    scan_clean_at(s, s->pos);
+}
+
+/* can a token start at offset at? Identifiers and numbers are read
+   greedily, so only after a non-word byte, or where a char literal (which
+   takes a fixed number of bytes) ended. */
+static int scan_token_start(const struct FindScan *s, size_t at)
+{
+    return at == 0 || !is_ident_char((unsigned char)s->p[at - 1]) || at == s->after_char;
+}
+
+/* advance the scan to offset upto. Comments, strings and char literals are
+   read whole with the lexer's own lex_span, so the scan may stop past upto;
+   a namespace name is a token, so the scan stops at upto inside it. */
+static void scan_to(struct FindScan *s, size_t upto)
+{
+    const char *p = s->p;
+    while (s->pos < upto)
+    {
+        if (s->state == FS_NAMESPACE)
+        {
+            s->pos = s->ns_end;
+            s->line = s->ns_line;
+            s->state = FS_CODE;
+            scan_clean(s);
+            continue;
+        }
+        char c = p[s->pos];
+        if (!scan_stop[(unsigned char)c])
+        {
+            s->pos = scan_skip_code(p, s->pos + 1, upto);
+            continue;
+        }
+        struct Src src = {p, s->len, s->pos + 1};
+        struct Span sp;
+        if (c == '\n')
+        {
+            s->pos++;
+            s->line++;
+            scan_clean(s);
+        }
+        else if (c == 'p' || c == 'i')
+        {
+            if (!scan_token_start(s, s->pos))
+            {
+                s->pos++;
+                continue;
+            }
+            /* read the word as the lexer does; package / import take the rest of the line */
+            size_t kw = s->pos;
+            int line = s->line;
+            lex_word(&src, &line);
+            char word[8];
+            size_t n = 0;
+            for (size_t k = kw; k < src.pos && n < sizeof(word) - 1; k++)
+                if (p[k] != '\r')
+                    word[n++] = p[k];
+            word[n] = '\0';
+            s->pos = src.pos;
+            s->line = line;
+            size_t ns_start, ns_end;
+            if (src.pos - kw > sizeof(word) - 1 || !is_namespace_kw(word, s->lang))
+                continue;
+            scan_clean_at(s, kw); /* lexing a hit in the namespace starts at the keyword */
+            if (!lex_namespace(&src, &line, &ns_start, &ns_end))
+            {
+                s->pos = src.pos;
+                s->line = line;
+                continue;
+            }
+            if (src.pos > upto)
+            {
+                s->ns_end = src.pos;
+                s->ns_line = line;
+                s->state = FS_NAMESPACE;
+                s->pos = upto;
+                break;
+            }
+            s->pos = src.pos;
+            s->line = line;
+            scan_clean(s);
+        }
+        else if (lex_span(&src, c, &s->line, &sp) == SPAN_CODE)
+            s->pos++;
+        else
+        {
+            s->pos = src.pos;
+            if (sp.kind == SPAN_CHAR)
+                s->after_char = s->pos;
+            else
+                scan_clean(s);
+        }
+    }
+}
+
+static __thread int *find_lines; /* matched lines of the current file */
+static __thread int find_nlines, find_cap;
+
+/* lex text[start..end) (starting on line first_line) and record the lines of pattern matches */
+static void find_in_region(struct FindJob *job, const char *text, size_t start, size_t end, int first_line, int lang)
+{
+    __atomic_fetch_add(&job->regions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->lexed, end - start, __ATOMIC_RELAXED);
+    if (!tokenize_buffer(text + start, end - start, lang))
+        return;
+    for (int i = 0; i + job->nterms <= tok_count; i++)
+    {
+        int t = 0;
+        for (; t < job->nterms; t++)
+        {
+            const struct FindTerm *term = &job->terms[t];
+            const struct Symbol *s = &table[i + t];
+            if ((term->kind && s->attribute != term->kind) || (term->text && strcmp(s->token, term->text) != 0))
+                break;
+        }
+        if (t < job->nterms)
+            continue;
+        int line = table[i].line + first_line - 1;
+        if (find_nlines && find_lines[find_nlines - 1] == line)
+            continue;
+        if (find_nlines == find_cap)
+        {
+            int cap = find_cap ? find_cap * 2 : 64;
+            int *grown = realloc(find_lines, (size_t)cap * sizeof(int));
+            if (!grown)
+                return;
+            find_lines = grown;
+            find_cap = cap;
+        }
+        find_lines[find_nlines++] = line;
+    }
+}
+
+static void find_file(struct FindJob *job, const char *path)
+{
+    size_t len;
+    const char *text = load_file(path, &len);
+    if (!text)
+        return;
+    __atomic_fetch_add(&job->bytes, len, __ATOMIC_RELAXED);
+    int lang = lang_for_file(path, job->lang);
+    find_nlines = 0;
+    if (!job->lit)
+        find_in_region(job, text, 0, len, 1, lang);
+    else
+    {
+        struct FindScan s = {text, len, 0, FS_CODE, 1, lang, 0, 0, 0, {0}, {0}, 0};
+        scan_clean(&s);
+        size_t reg_start = 0, reg_end = 0; /* pending region, merged while hits overlap */
+        int reg_line = 0, any = 0;
+        for (const char *h = text; (h = find_literal(h, (size_t)(text + len - h), job->lit, job->lit_len)); h++)
+        {
+            size_t at = (size_t)(h - text);
+            /* identifiers are read greedily, so a word literal must end the word; its
+               start is left to the scan (a broken char literal can eat a prefix) */
+            if (job->lit_word_end && at + job->lit_len < len && is_ident_char((unsigned char)text[at + job->lit_len]))
+                continue;
+            if (at < s.pos)
+                continue; /* inside an identifier or literal the scan already stepped over */
+            scan_to(&s, at);
+            if (s.state == FS_NAMESPACE)
+                ; /* part of a NAMESPACE token: lexing decides */
+            else if (s.state != FS_CODE || s.pos > at || (job->lit_word_start && !scan_token_start(&s, at)))
+                continue; /* in a comment, string or the middle of a word */
+            if (!any++)
+                __atomic_fetch_add(&job->hit_files, 1, __ATOMIC_RELAXED);
+            /* restart from the earliest clean point within the lines a match can
+               span, or at least from the latest one */
+            unsigned newest = (s.nclean - 1) % FIND_RING;
+            size_t start = s.clean_pos[newest];
+            int start_line = s.clean_line[newest];
+            for (unsigned k = 1; k < FIND_RING && k < s.nclean; k++)
+            {
+                unsigned r = (s.nclean - 1 - k) % FIND_RING;
+                if (s.clean_line[r] < s.line - (job->nterms - 1))
+                    break;
+                start = s.clean_pos[r];
+                start_line = s.clean_line[r];
+            }
+            size_t end = at;
+            for (int n = 0; n < job->nterms && end < len; n++)
+            {
+                const char *nl = memchr(text + end, '\n', len - end);
+                end = nl ? (size_t)(nl - text) + 1 : len;
+            }
+            if (reg_end && start <= reg_end)
+            {
+                reg_end = end > reg_end ? end : reg_end;
+                continue;
+            }
+            if (reg_end)
+                find_in_region(job, text, reg_start, reg_end, reg_line, lang);
+            reg_start = start;
+            reg_end = end;
+            reg_line = start_line;
+        }
+        if (reg_end)
+            find_in_region(job, text, reg_start, reg_end, reg_line, lang);
+    }
+    if (!find_nlines)
+        return;
+    __atomic_fetch_add(&job->matches, (uint64_t)find_nlines, __ATOMIC_RELAXED);
+    /* grep-style output; one file's lines stay together */
+    flockfile(stdout);
+    const char *p = text, *end = text + len;
+    int line = 1;
+    for (int k = 0; k < find_nlines; k++)
+    {
+        for (; line < find_lines[k] && p < end; line++)
+        {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            p = nl ? nl + 1 : end;
+        }
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        if (n && p[n - 1] == '\r')
+            n--;
+        printf("%s:%d:%.*s\n", path, find_lines[k], (int)n, p);
+    }
+    funlockfile(stdout);
+}
+
+static void *find_worker(void *arg)
+{
+    struct FindJob *job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nfiles)
+        find_file(job, job->paths[i]);
+    return NULL;
+}
+
+/* parse "KIND:text KIND text ..." into terms; returns 0 on a bad pattern */
+static int parse_find_pattern(struct FindJob *job, char *pattern)
+{
+    for (char *tok = strtok(pattern, " \t"); tok; tok = strtok(NULL, " \t"))
+    {
+        if (job->nterms == FIND_MAX_TERMS)
+            return 0;
+        struct FindTerm *t = &job->terms[job->nterms++];
+        char *colon = strchr(tok, ':');
+        t->kind = 0;
+        t->text = tok;
+        for (int a = 1; a <= 8; a++)
+        {
+            size_t n = strlen(attrLabel(a));
+            if (strncmp(tok, attrLabel(a), n) == 0 && (tok[n] == 0 || tok + n == colon))
+            {
+                t->kind = a;
+                t->text = tok[n] ? colon + 1 : NULL;
+            }
+        }
+        if (t->text && (!job->lit || strlen(t->text) > job->lit_len))
+        {
+            job->lit = t->text;
+            job->lit_len = strlen(t->text);
+        }
+    }
+    if (job->lit)
+    {
+        job->lit_word_end = is_ident_char((unsigned char)job->lit[job->lit_len - 1]);
+        job->lit_word_start = is_ident_char((unsigned char)job->lit[0]);
+    }
+    return job->nterms > 0 && (!job->lit || job->lit_len > 0);
+}
+
+static int run_find(char *pattern, char **paths, int npaths, int lang, int workers)
+{
+    struct FindJob job;
+    memset(&job, 0, sizeof(job));
+    if (!parse_find_pattern(&job, pattern))
+    {
+        fprintf(stderr, "%sERROR:%s bad pattern\n", PASTEL_ERROR1, COL_RESET);
+        return 2;
+    }
+    double t0 = now_sec();
+    struct PathList list = {0};
+    for (int i = 0; i < npaths; i++)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode))
+            walk_tree(paths[i], &list);
+        else
+            path_push(&list, paths[i]);
+    }
+    job.paths = list.v;
+    job.nfiles = list.n;
+    job.lang = lang;
+
+    keep_comments = 0;
+    scan_stop_init();
+    pthread_t *tids = calloc((size_t)workers, sizeof(*tids));
+    int started = 0;
+    for (int i = 0; tids && i < workers; i++)
+        if (pthread_create(&tids[started], NULL, find_worker, &job) == 0)
+            started++;
+    if (started == 0)
+        find_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    double wall = now_sec() - t0;
+    fflush(stdout);
+    fprintf(stderr, "find: %d files, %.1f MB in %.1f ms (%.0f MB/s, %d threads); %llu files with hits in code, "
+                    "%llu regions lexed (%.2f MB), %llu matching lines\n",
+            list.n, job.bytes / 1e6, wall * 1e3, job.bytes / 1e6 / wall, started ? started : 1,
+            (unsigned long long)job.hit_files, (unsigned long long)job.regions, job.lexed / 1e6,
+            (unsigned long long)job.matches);
+    for (int i = 0; i < list.n; i++)
+        free(list.v[i]);
+    free(list.v);
+    return job.matches ? 0 : 1;
+}
+
+/* ---------- Syntax highlighting (--highlight ansi|html) ----------
+   The source is streamed back out unchanged, with each token and comment span
+   wrapped in a color (ANSI) or a <span class> (HTML); whitespace and anything
+   the lexer skips are copied as they are. All output goes through one buffer
+   that is written with write(2) when full, so there is no stdio call per token. */
+
+#define HL_BUF (1 << 18)
+#define HL_COMMENT 9 /* span kind after the token attributes 1..8 */
+
+enum
+{
+    HL_ANSI,
+    HL_HTML
+};
+
+struct HlOut
+{
+    char *buf;
+    size_t used;
+    int fd;       /* -1: discard (--bench) */
+    double bytes; /* written so far */
+    int failed;
+};
+
+static void hl_flush(struct HlOut *o)
+{
+    o->bytes += o->used;
+    size_t done = 0;
+    while (o->fd >= 0 && !o->failed && done < o->used)
+    {
+        ssize_t n = write(o->fd, o->buf + done, o->used - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            o->failed = 1;
+        else
+            done += (size_t)n;
+    }
+    o->used = 0;
+}
+
+static void hl_put(struct HlOut *o, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+        if (o->used == HL_BUF)
+            hl_flush(o);
+        size_t room = HL_BUF - o->used;
+        size_t k = n < room ? n : room;
+        memcpy(o->buf + o->used, p, k);
+        o->used += k;
+        p += k;
+        n -= k;
+    }
+}
+
+/* HTML text: copy runs of plain bytes, replace & < > */
+static void hl_put_html(struct HlOut *o, const char *p, size_t n)
+{
+    size_t run = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const char *ent;
+        switch (p[i])
+        {
+        case '&':
+            ent = "&amp;";
+            break;
+        case '<':
+            ent = "&lt;";
+            break;
+        case '>':
+            ent = "&gt;";
+            break;
+        default:
+            continue;
+        }
+        hl_put(o, p + run, i - run);
+        hl_put(o, ent, strlen(ent));
+        run = i + 1;
+    }
+    hl_put(o, p + run, n - run);
+}
+
+static const char *const hl_class[HL_COMMENT + 1] = {"", "kw", "id", "num", "op", "sep", "str", "chr", "ns", "com"};
+
+static const char hl_css[] =
+    "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><style>\n"
+    "body{background:#1c1c1c;color:#d0d0d0}\n"
+    "pre.lex{font-family:monospace}\n"
+    ".kw{color:#d75fd7}.id{color:#87ff87}.num{color:#afffff}.op{color:#ffff87}\n"
+    ".sep{color:#949494}.str{color:#ffaf5f}.chr{color:#d7af87}.ns{color:#808080}\n"
+    ".com{color:#afd7ff;font-style:italic}\n"
+    "</style></head><body>\n";
+
+/* render the file held in the tables; text is the buffer it was lexed from */
+static void hl_render(struct HlOut *o, const char *text, size_t len, int mode)
+{
+    const char *open[HL_COMMENT + 1], *close;
+    char tags[HL_COMMENT + 1][24];
+    size_t open_len[HL_COMMENT + 1], close_len;
+    for (int k = 0; k <= HL_COMMENT; k++)
+    {
+        if (mode == HL_ANSI)
+            open[k] = k == HL_COMMENT ? PASTEL_COMMENT : attrColor(k);
+        else
+        {
+            snprintf(tags[k], sizeof(tags[k]), "<span class=\"%s\">", hl_class[k]);
+            open[k] = tags[k];
+        }
+        open_len[k] = strlen(open[k]);
+    }
+    close = mode == HL_ANSI ? COL_RESET : "</span>";
+    close_len = strlen(close);
+    void (*put_text)(struct HlOut *, const char *, size_t) = mode == HL_ANSI ? hl_put : hl_put_html;
+
+    /* tokens and comments are each in source order and never overlap */
+    size_t pos = 0;
+    int i = 0, j = 0;
+    while (i < tok_count || j < com_count)
+    {
+        size_t off, end;
+        int kind;
+        if (j == com_count || (i < tok_count && table[i].off < (size_t)(comments[j].text - text)))
+        {
+            off = table[i].off;
+            end = off + table[i].len;
+            kind = table[i++].attribute;
+        }
+        else
+        {
+            off = (size_t)(comments[j].text - text);
+            end = off + (size_t)comments[j++].len;
+            kind = HL_COMMENT;
+        }
+        if (off < pos)
+            off = pos;
+        if (end <= off || end > len)
+            continue;
+        put_text(o, text + pos, off - pos);
+        hl_put(o, open[kind], open_len[kind]);
+        put_text(o, text + off, end - off);
+        hl_put(o, close, close_len);
+        pos = end;
+    }
+    put_text(o, text + pos, len - pos);
+}
+
+static int run_highlight(const char *mode_s, char **files, int nfiles, int lang, int iters)
+{
+    int mode = strcmp(mode_s, "ansi") == 0 ? HL_ANSI : strcmp(mode_s, "html") == 0 ? HL_HTML
+                                                                                   : -1;
+    struct HlOut o = {malloc(HL_BUF), 0, iters ? -1 : 1, 0, 0};
+    if (mode < 0 || !o.buf)
+    {
+        fprintf(stderr, "%sERROR:%s --highlight takes ansi or html\n", PASTEL_ERROR1, COL_RESET);
+        free(o.buf);
+        return 2;
+    }
+    fflush(stdout); /* everything below bypasses stdio */
+    int status = 0;
+    double in_bytes = 0, lex_secs = 0, render_secs = 0;
+    if (mode == HL_HTML)
+        hl_put(&o, hl_css, sizeof(hl_css) - 1);
+    for (int f = 0; f < nfiles; f++)
+    {
+        size_t len;
+        const char *text = load_file(files[f], &len);
+        if (!text || len > 0xffffffffu) /* spans are 32-bit offsets */
+        {
+            fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, files[f]);
+            status = 1;
+            continue;
+        }
+        double t0 = now_sec();
+        if (!tokenize_buffer(text, len, lang_for_file(files[f], lang)))
+        {
+            fprintf(stderr, "%sERROR:%s Could not lex %s\n", PASTEL_ERROR1, COL_RESET, files[f]);
+            status = 1;
+            continue;
+        }
+        double t1 = now_sec();
+        for (int it = 0; it < (iters ? iters : 1); it++)
+        {
+            if (mode == HL_HTML)
+            {
+                hl_put(&o, "<h3>", 4);
+                hl_put_html(&o, files[f], strlen(files[f]));
+                hl_put(&o, "</h3>\n<pre class=\"lex\">", 23);
+            }
+            else if (nfiles > 1)
+            {
+                hl_put(&o, PASTEL_HDR_BG, strlen(PASTEL_HDR_BG));
+                hl_put(&o, files[f], strlen(files[f]));
+                hl_put(&o, COL_RESET "\n", strlen(COL_RESET) + 1);
+            }
+            hl_render(&o, text, len, mode);
+            if (mode == HL_HTML)
+                hl_put(&o, "</pre>\n", 7);
+        }
+        lex_secs += t1 - t0;
+        render_secs += now_sec() - t1;
+        in_bytes += (double)len * (iters ? iters : 1);
+    }
+    if (mode == HL_HTML)
+        hl_put(&o, "</body></html>\n", 15);
+    hl_flush(&o);
+    free(o.buf);
+    if (o.failed)
+    {
+        fprintf(stderr, "%sERROR:%s write failed: %s\n", PASTEL_ERROR1, COL_RESET, strerror(errno));
+        return 1;
+    }
+    if (iters)
+        printf("highlight %s: lex %.1f ms, render %.1f ms per pass; in %.1f MB/s, out %.1f MB/s (%.2fx source)\n", mode_s,
+               lex_secs * 1e3, render_secs * 1e3 / iters, in_bytes / render_secs / 1e6, o.bytes / render_secs / 1e6,
+               o.bytes / in_bytes);
+    return status;
+}
+
+/* ---------- Source archives (--archive ARCHIVE...) ----------
+   Sources are lexed straight out of .jar/.zip files and tarballs, nothing is
+   extracted to disk. A zip's central directory is read from the mmap'd file and
+   its .java/.kt entries are claimed by the workers, which decompress each one
+   (stored, deflate or zstd) into a per-thread buffer reused from entry to entry;
+   stored entries are lexed in place. A tar stream (.tar, .tar.gz, .tar.zst)
+   can only be read front to back: the main thread decompresses it into batches
+   of sources while the workers analyze the previous batch. A lone .java.gz or
+   .kt.zst is one entry. Reports are named archive!path and come out in archive
+   order. libzstd is optional and loaded at run time, so the build needs only zlib. */
+
+#define ARCHIVE_BATCH (32 << 20)     /* tar: source bytes handed to the workers at once */
+#define ARCHIVE_MAX_ENTRY (1u << 30) /* larger entries are refused (decompression bombs) */
+
+enum
+{
+    UNPACK_STORED,
+    UNPACK_DEFLATE, /* raw deflate, as in zip */
+    UNPACK_GZIP,
+    UNPACK_ZSTD,
+    UNPACK_FILE /* a file on disk (--bench: the extract-then-lex baseline) */
+};
+
+/* the part of the zstd streaming API used here (zstd.h) */
+struct ZstdInBuf
+{
+    const void *src;
+    size_t size, pos;
+};
+struct ZstdOutBuf
+{
+    void *dst;
+    size_t size, pos;
+};
+static struct
+{
+    void *(*create)(void);
+    size_t (*init)(void *);
+    size_t (*decompress)(void *, struct ZstdOutBuf *, struct ZstdInBuf *);
+    unsigned (*is_error)(size_t);
+    size_t (*release)(void *);
+    int loaded;
+} zstd;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+static void zstd_load(void)
+{
+    void *lib = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+        lib = dlopen("libzstd.so", RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+        return;
+    zstd.create = (void *(*)(void))dlsym(lib, "ZSTD_createDStream");
+    zstd.init = (size_t(*)(void *))dlsym(lib, "ZSTD_initDStream");
+    zstd.decompress = (size_t(*)(void *, struct ZstdOutBuf *, struct ZstdInBuf *))dlsym(lib, "ZSTD_decompressStream");
+    zstd.is_error = (unsigned (*)(size_t))dlsym(lib, "ZSTD_isError");
+    zstd.release = (size_t(*)(void *))dlsym(lib, "ZSTD_freeDStream");
+    zstd.loaded = zstd.create && zstd.init && zstd.decompress && zstd.is_error && zstd.release;
+}
+
+static int zstd_available(void)
+{
+    pthread_once(&zstd_once, zstd_load);
+    return zstd.loaded;
+}
+
+/* one decompression stream over an in-memory input; the zlib / zstd state
+   stays allocated and is only reset for the next entry */
+struct Unpack
+{
+    int codec;
+    const unsigned char *in;
+    size_t in_len, in_pos;
+    int end;
+    z_stream z;
+    int z_bits; /* window bits z is set up for, 0: not set up */
+    void *zd;   /* ZSTD_DStream */
+};
+
+static int unpack_start(struct Unpack *u, int codec, const unsigned char *in, size_t len)
+{
+    u->codec = codec;
+    u->in = in;
+    u->in_len = len;
+    u->in_pos = 0;
+    u->end = 0;
+    if (codec == UNPACK_DEFLATE || codec == UNPACK_GZIP)
+    {
+        int bits = codec == UNPACK_GZIP ? 16 + MAX_WBITS : -MAX_WBITS;
+        if (u->z_bits == bits)
+            return inflateReset(&u->z) == Z_OK;
+        if (u->z_bits)
+            inflateEnd(&u->z);
+        memset(&u->z, 0, sizeof(u->z));
+        u->z_bits = inflateInit2(&u->z, bits) == Z_OK ? bits : 0;
+        return u->z_bits != 0;
+    }
+    if (codec == UNPACK_ZSTD)
+    {
+        if (!zstd_available() || (!u->zd && !(u->zd = zstd.create())))
+            return 0;
+        return !zstd.is_error(zstd.init(u->zd));
+    }
+    return 1;
+}
+
+static void unpack_end(struct Unpack *u)
+{
+    if (u->z_bits)
+        inflateEnd(&u->z);
+    if (u->zd)
+        zstd.release(u->zd);
+    memset(u, 0, sizeof(*u));
+}
+
+/* decompress up to cap bytes into dst: the count (short only at the end of
+   the input), -1 if the input is corrupt or truncated */
+static long unpack_read(struct Unpack *u, unsigned char *dst, size_t cap)
+{
+    size_t out = 0;
+    while (out < cap && !u->end)
+    {
+        size_t avail = u->in_len - u->in_pos;
+        if (u->codec == UNPACK_STORED)
+        {
+            size_t k = avail < cap - out ? avail : cap - out;
+            if (k)
+                memcpy(dst + out, u->in + u->in_pos, k);
+            u->in_pos += k;
+            out += k;
+            u->end = u->in_pos == u->in_len;
+        }
+        else if (u->codec == UNPACK_ZSTD)
+        {
+            struct ZstdInBuf zi = {u->in, u->in_len, u->in_pos};
+            struct ZstdOutBuf zo = {dst, cap, out};
+            size_t r = zstd.decompress(u->zd, &zo, &zi);
+            if (zstd.is_error(r))
+                return -1;
+            u->in_pos = zi.pos;
+            out = zo.pos;
+            /* output room left means the decoder has flushed everything it can */
+            if (u->in_pos == u->in_len && out < cap)
+            {
+                if (r != 0)
+                    return -1;
+                u->end = 1;
+            }
+        }
+        else
+        {
+            uInt in_n = avail > (1u << 30) ? 1u << 30 : (uInt)avail;
+            uInt out_n = cap - out > (1u << 30) ? 1u << 30 : (uInt)(cap - out);
+            u->z.next_in = (Bytef *)(u->in + u->in_pos);
+            u->z.avail_in = in_n;
+            u->z.next_out = dst + out;
+            u->z.avail_out = out_n;
+            int r = inflate(&u->z, Z_NO_FLUSH);
+            u->in_pos += in_n - u->z.avail_in;
+            out += out_n - u->z.avail_out;
+            if (r == Z_STREAM_END)
+            {
+                /* a gzip file may hold several members back to back */
+                if (u->codec == UNPACK_GZIP && u->in_len - u->in_pos >= 2 && u->in[u->in_pos] == 0x1f &&
+                    u->in[u->in_pos + 1] == 0x8b)
+                {
+                    if (inflateReset(&u->z) != Z_OK)
+                        return -1;
+                }
+                else
+                    u->end = 1;
+            }
+            else if (r != Z_OK)
+                return -1;
+        }
+    }
+    return (long)out;
+}
+
+/* pass over n bytes of the stream; 0 if it ends first or is corrupt */
+static int unpack_skip(struct Unpack *u, uint64_t n)
+{
+    if (u->codec == UNPACK_STORED)
+    {
+        if (n > u->in_len - u->in_pos)
+            return 0;
+        u->in_pos += n;
+        return 1;
+    }
+    unsigned char scratch[16384];
+    while (n)
+    {
+        size_t k = n < sizeof(scratch) ? (size_t)n : sizeof(scratch);
+        if (unpack_read(u, scratch, k) != (long)k)
+            return 0;
+        n -= k;
+    }
+    return 1;
+}
+
+struct ArchiveEntry
+{
+    char *name;                /* path inside the archive */
+    const unsigned char *data; /* compressed bytes */
+    uint64_t csize, usize;
+    uint32_t crc;
+    int method;      /* UNPACK_* */
+    int has_crc;     /* zip: usize and crc are checked */
+    const char *bad; /* why it cannot be read, or NULL */
+};
+struct ArchiveList
+{
+    struct ArchiveEntry *v;
+    int n, cap;
+};
+struct ArchiveJob
+{
+    const char *archive;
+    struct ArchiveEntry *v;
+    int n;
+    int next; /* next entry to claim (atomic) */
+    int lang, fmt; /* fmt -1: no reports (--bench) */
+    const char *extract_dir; /* --bench: write the entries here instead of analyzing them */
+    int base;                /* entries in earlier batches (names of extracted files) */
+    pthread_t *tids;
+    int started;
+    /* reports are written in entry order: a finished report waits in its slot */
+    pthread_mutex_t lock;
+    char **rep;
+    size_t *rep_len;
+    char *done;
+    int emitted;
+    uint64_t bytes, failed; /* atomic */
+};
+struct ArchiveStats
+{
+    uint64_t sources, bytes, failed;
+    double read; /* archive bytes */
+    int threads;
+};
+
+static struct ArchiveEntry *archive_push(struct ArchiveList *l, const char *name, size_t name_len)
+{
+    if (l->n == l->cap)
+    {
+        int cap = l->cap ? l->cap * 2 : 1024;
+        struct ArchiveEntry *grown = realloc(l->v, (size_t)cap * sizeof(*grown));
+        if (!grown)
+            return NULL;
+        l->v = grown;
+        l->cap = cap;
+    }
+    struct ArchiveEntry *e = &l->v[l->n];
+    memset(e, 0, sizeof(*e));
+    if (!(e->name = strndup(name, name_len)))
+        return NULL;
+    l->n++;
+    return e;
+}
+
+static void archive_clear(struct ArchiveList *l)
+{
+    for (int i = 0; i < l->n; i++)
+        free(l->v[i].name);
+    l->n = 0;
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint64_t le64(const unsigned char *p)
+{
+    return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+/* list the .java/.kt entries of a zip / jar from its central directory.
+   Returns 1, 0 if m is not a zip (no end record), -1 if it is corrupt. */
+static int zip_entries(const unsigned char *m, size_t size, struct ArchiveList *out, const char **why)
+{
+    /* the end record sits before a comment of at most 64 KB */
+    size_t eocd = 0;
+    int found = 0;
+    for (size_t p = size >= 22 ? size - 22 + 1 : 0; p-- > 0 && size - p <= 22 + 65535;)
+        if (le32(m + p) == 0x06054b50 && p + 22 + le16(m + p + 20) == size)
+        {
+            eocd = p;
+            found = 1;
+            break;
+        }
+    if (!found)
+        return 0;
+    uint64_t count = le16(m + eocd + 10), cd_size = le32(m + eocd + 12), cd_off = le32(m + eocd + 16);
+    if ((count == 0xFFFF || cd_size == 0xFFFFFFFF || cd_off == 0xFFFFFFFF) && eocd >= 20 &&
+        le32(m + eocd - 20) == 0x07064b50)
+    {
+        uint64_t z = le64(m + eocd - 20 + 8); /* zip64 end record */
+        if (size < 56 || z > size - 56 || le32(m + z) != 0x06064b50)
+        {
+            *why = "bad zip64 end record";
+            return -1;
+        }
+        count = le64(m + z + 32);
+        cd_size = le64(m + z + 40);
+        cd_off = le64(m + z + 48);
+    }
+    if (cd_off > size || cd_size > size - cd_off)
+    {
+        *why = "central directory out of bounds";
+        return -1;
+    }
+    if (count > cd_size / 46) /* every entry takes at least 46 bytes */
+    {
+        *why = "bad central directory";
+        return -1;
+    }
+    const unsigned char *p = m + cd_off, *end = p + cd_size;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (end - p < 46 || le32(p) != 0x02014b50)
+        {
+            *why = "bad central directory entry";
+            return -1;
+        }
+        int flags = le16(p + 8), method = le16(p + 10);
+        uint64_t csize = le32(p + 20), usize = le32(p + 24), lho = le32(p + 42);
+        size_t nlen = le16(p + 28), xlen = le16(p + 30), clen = le16(p + 32);
+        if ((size_t)(end - p) < 46 + nlen + xlen + clen)
+        {
+            *why = "bad central directory entry";
+            return -1;
+        }
+        const unsigned char *name = p + 46, *x = name + nlen, *xend = x + xlen;
+        /* zip64 extra field: 64-bit values of the saturated fields, in this order */
+        for (; xend - x >= 4 && (size_t)(xend - x) >= 4u + le16(x + 2); x += 4 + le16(x + 2))
+        {
+            if (le16(x) != 0x0001)
+                continue;
+            const unsigned char *v = x + 4, *vend = v + le16(x + 2);
+            if (usize == 0xFFFFFFFF && vend - v >= 8)
+            {
+                usize = le64(v);
+                v += 8;
+            }
+            if (csize == 0xFFFFFFFF && vend - v >= 8)
+            {
+                csize = le64(v);
+                v += 8;
+            }
+            if (lho == 0xFFFFFFFF && vend - v >= 8)
+                lho = le64(v);
+        }
+        const unsigned char *rec = p;
+        p += 46 + nlen + xlen + clen;
+        if (nlen == 0 || name[nlen - 1] == '/')
+            continue;
+        struct ArchiveEntry *e = archive_push(out, (const char *)name, nlen);
+        if (!e)
+        {
+            *why = "out of memory";
+            return -1;
+        }
+        if (!is_source_file(e->name))
+        {
+            free(e->name);
+            out->n--;
+            continue;
+        }
+        e->csize = csize;
+        e->usize = usize;
+        e->crc = le32(rec + 16);
+        e->has_crc = 1;
+        e->method = method == 0 ? UNPACK_STORED : method == 8 ? UNPACK_DEFLATE : UNPACK_ZSTD;
+        uint64_t data = lho + 30;
+        if (lho > size - 30 || le32(m + lho) != 0x04034b50 ||
+            (data += le16(m + lho + 26) + (uint64_t)le16(m + lho + 28)) > size || csize > size - data)
+            e->bad = "entry out of bounds";
+        else if (flags & 1)
+            e->bad = "encrypted";
+        else if (method != 0 && method != 8 && method != 93)
+            e->bad = "unsupported compression method";
+        else if (usize > ARCHIVE_MAX_ENTRY)
+            e->bad = "entry too large";
+        else
+            e->data = m + data;
+    }
+    return 1;
+}
+
+/* tar header fields: octal, or base-256 for large values (GNU) */
+static uint64_t tar_number(const unsigned char *p, int n)
+{
+    uint64_t v = 0;
+    int i = 0;
+    if (p[0] & 0x80)
+    {
+        for (v = p[0] & 0x7f, i = 1; i < n; i++)
+            v = v << 8 | p[i];
+        return v;
+    }
+    while (i < n && p[i] == ' ')
+        i++;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+        v = v * 8 + (uint64_t)(p[i] - '0');
+    return v;
+}
+
+static int tar_header_ok(const unsigned char *h)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    return sum == tar_number(h + 148, 8);
+}
+
+static int tar_zero_block(const unsigned char *h)
+{
+    for (int i = 0; i < 512; i++)
+        if (h[i])
+            return 0;
+    return 1;
+}
+
+/* a tar stream read into batches: the sources of a batch are consecutive in buf */
+struct TarReader
+{
+    struct Unpack u;
+    unsigned char hdr[512];
+    int have_hdr;    /* hdr holds the next header (read while detecting the format) */
+    char *long_name; /* GNU 'L' or pax path record for the next member */
+};
+struct ArchiveBatch
+{
+    struct ArchiveList list;
+    unsigned char *buf;
+    size_t used, cap;
+};
+
+static int batch_reserve(struct ArchiveBatch *b, size_t n)
+{
+    if (b->used + n <= b->cap)
+        return 1;
+    size_t cap = b->cap ? b->cap : ARCHIVE_BATCH + 65536;
+    while (cap < b->used + n)
+        cap *= 2;
+    unsigned char *grown = realloc(b->buf, cap);
+    if (!grown)
+        return 0;
+    b->buf = grown;
+    b->cap = cap;
+    return 1;
+}
+
+/* a pax extended header: the path record, if there is one */
+static char *pax_path(const char *rec, size_t n)
+{
+    char *path = NULL;
+    for (size_t i = 0; i < n;)
+    {
+        size_t len = 0, k = i;
+        for (; k < n && rec[k] >= '0' && rec[k] <= '9'; k++)
+            len = len * 10 + (size_t)(rec[k] - '0');
+        if (len == 0 || len > n - i)
+            break;
+        if (len - (k - i) > 6 && memcmp(rec + k, " path=", 6) == 0)
+        {
+            free(path);
+            path = strndup(rec + k + 6, len - (k - i) - 7);
+        }
+        i += len;
+    }
+    return path;
+}
+
+/* read tar members until the batch is full: 1 if the archive goes on,
+   0 at its end, -1 if it is corrupt (*why set) */
+static int tar_fill(struct TarReader *t, struct ArchiveBatch *b, const char **why)
+{
+    while (b->used < ARCHIVE_BATCH)
+    {
+        if (!t->have_hdr)
+        {
+            long got = unpack_read(&t->u, t->hdr, 512);
+            if (got == 0)
+                return 0; /* no end blocks: accepted, as tar does */
+            if (got != 512)
+            {
+                *why = "truncated tar archive";
+                return -1;
+            }
+        }
+        t->have_hdr = 0;
+        const unsigned char *h = t->hdr;
+        if (tar_zero_block(h))
+            return 0;
+        if (!tar_header_ok(h))
+        {
+            *why = "bad tar header checksum";
+            return -1;
+        }
+        uint64_t size = tar_number(h + 124, 12), padded = (size + 511) & ~(uint64_t)511;
+        int type = h[156];
+        if (type == 'L' || type == 'x')
+        {
+            char *rec = size <= 65536 ? malloc(padded) : NULL;
+            if (!rec || unpack_read(&t->u, (unsigned char *)rec, padded) != (long)padded)
+            {
+                free(rec);
+                *why = "bad tar name record";
+                return -1;
+            }
+            free(t->long_name);
+            t->long_name = type == 'L' ? strndup(rec, strnlen(rec, size)) : pax_path(rec, size);
+            free(rec);
+            continue;
+        }
+        char name[257];
+        const char *full = t->long_name;
+        if (!full)
+        {
+            if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+                snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+            else
+                snprintf(name, sizeof(name), "%.100s", (const char *)h);
+            full = name;
+        }
+        struct ArchiveEntry *e = NULL;
+        if ((type == '0' || type == 0 || type == '7') && is_source_file(full))
+        {
+            if (!(e = archive_push(&b->list, full, strlen(full))))
+            {
+                *why = "out of memory";
+                return -1;
+            }
+            e->method = UNPACK_STORED;
+            if (size > ARCHIVE_MAX_ENTRY)
+                e->bad = "entry too large";
+            else if (!batch_reserve(b, padded))
+                e->bad = "out of memory";
+        }
+        free(t->long_name);
+        t->long_name = NULL;
+        if (!e || e->bad)
+        {
+            if (!unpack_skip(&t->u, padded))
+            {
+                *why = "truncated tar archive";
+                return -1;
+            }
+            continue;
+        }
+        if (unpack_read(&t->u, b->buf + b->used, padded) != (long)padded)
+        {
+            *why = "truncated tar archive";
+            return -1;
+        }
+        e->csize = size;
+        b->used += size;
+    }
+    return 1;
+}
+
+static __thread unsigned char *entry_buf;
+static __thread size_t entry_cap;
+static __thread struct Unpack entry_unpack;
+
+static int entry_reserve(size_t n)
+{
+    if (n <= entry_cap)
+        return 1;
+    size_t cap = entry_cap ? entry_cap : 65536;
+    while (cap < n)
+        cap *= 2;
+    unsigned char *grown = realloc(entry_buf, cap);
+    if (!grown)
+        return 0;
+    entry_buf = grown;
+    entry_cap = cap;
+    return 1;
+}
+
+/* the entry's source: in place for stored entries, else in the thread's
+   buffer; NULL with *why set */
+static const char *archive_read_entry(const struct ArchiveEntry *e, size_t *len, const char **why)
+{
+    if (e->bad)
+    {
+        *why = e->bad;
+        return NULL;
+    }
+    if (e->method == UNPACK_FILE)
+    {
+        int fd = open(e->name, O_RDONLY);
+        struct stat st;
+        size_t n = 0;
+        ssize_t got = 0;
+        if (fd >= 0 && fstat(fd, &st) == 0 && entry_reserve((size_t)st.st_size + 1))
+            for (; n < (size_t)st.st_size; n += (size_t)got)
+                if ((got = read(fd, entry_buf + n, (size_t)st.st_size - n)) <= 0)
+                    break;
+        if (fd >= 0)
+            close(fd);
+        if (fd < 0 || got < 0)
+        {
+            *why = "could not read";
+            return NULL;
+        }
+        *len = n;
+        return (const char *)entry_buf;
+    }
+    const unsigned char *text = e->data;
+    size_t n = e->csize;
+    if (e->method != UNPACK_STORED)
+    {
+        if (!unpack_start(&entry_unpack, e->method, e->data, e->csize))
+        {
+            *why = e->method == UNPACK_ZSTD && !zstd_available() ? "zstd compressed, but libzstd is not available"
+                                                                   : "out of memory";
+            return NULL;
+        }
+        /* a zip entry's size is known up front; a lone .gz / .zst grows the buffer */
+        uint64_t limit = e->has_crc ? e->usize : ARCHIVE_MAX_ENTRY;
+        long got;
+        n = 0;
+        do
+        {
+            if (!entry_reserve(e->has_crc && n <= limit ? (size_t)limit + 1 : n + 65536))
+            {
+                *why = "out of memory";
+                return NULL;
+            }
+            if ((got = unpack_read(&entry_unpack, entry_buf + n, entry_cap - n)) < 0)
+            {
+                *why = "corrupt compressed data";
+                return NULL;
+            }
+            n += (size_t)got;
+            if (n > limit)
+            {
+                *why = e->has_crc ? "size mismatch" : "entry too large";
+                return NULL;
+            }
+        } while (got > 0);
+        text = entry_buf;
+    }
+    if (e->has_crc && (n != e->usize || crc32(0, text, (uInt)n) != e->crc))
+    {
+        *why = n != e->usize ? "size mismatch" : "CRC mismatch";
+        return NULL;
+    }
+    *len = n;
+    return (const char *)text;
+}
+
+static int archive_extract(const struct ArchiveJob *job, int i, const char *text, size_t len)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%07d%s", job->extract_dir, job->base + i, strrchr(job->v[i].name, '.'));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    for (size_t off = 0; off < len;)
+    {
+        ssize_t w = write(fd, text + off, len - off);
+        if (w <= 0)
+        {
+            close(fd);
+            return 0;
+        }
+        off += (size_t)w;
+    }
+    return close(fd) == 0;
+}
+
+/* hand a finished report over; whoever completes the next one in order writes
+   out everything that is ready */
+static void archive_emit(struct ArchiveJob *job, int i, char *rep, size_t len)
+{
+    pthread_mutex_lock(&job->lock);
+    job->rep[i] = rep;
+    job->rep_len[i] = len;
+    job->done[i] = 1;
+    for (; job->emitted < job->n && job->done[job->emitted]; job->emitted++)
+    {
+        int k = job->emitted;
+        if (job->rep[k])
+            fwrite(job->rep[k], 1, job->rep_len[k], stdout);
+        free(job->rep[k]);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void archive_entry(struct ArchiveJob *job, int i)
+{
+    const struct ArchiveEntry *e = &job->v[i];
+    size_t len = 0;
+    const char *why = NULL;
+    const char *text = archive_read_entry(e, &len, &why);
+    char *rep = NULL;
+    size_t rep_len = 0;
+    if (text && job->extract_dir && !archive_extract(job, i, text, len))
+        why = "could not extract";
+    else if (text && !job->extract_dir && !tokenize_buffer(text, len, lang_for_file(e->name, job->lang)))
+        why = "could not lex";
+    if (!text || why)
+    {
+        fprintf(stderr, "%sERROR:%s %s!%s: %s\n", PASTEL_ERROR1, COL_RESET, job->archive, e->name, why);
+        __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    else if (!job->extract_dir)
+    {
+        __atomic_fetch_add(&job->bytes, (uint64_t)len, __ATOMIC_RELAXED);
+        detect_errors_pass2();
+        FILE *out = job->fmt >= 0 ? open_memstream(&rep, &rep_len) : NULL;
+        if (out)
+        {
+            char name[8192];
+            snprintf(name, sizeof(name), "%s!%s", job->archive, e->name);
+            print_report(out, name, job->fmt);
+            fclose(out);
+        }
+    }
+    archive_emit(job, i, rep, rep_len);
+}
+
+static void *archive_worker(void *arg)
+{
+    struct ArchiveJob *job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+        archive_entry(job, i);
+    /* workers live for one archive or batch: give back what the thread held */
+    unpack_end(&entry_unpack);
+    free(entry_buf);
+    entry_buf = NULL;
+    entry_cap = 0;
+    arena_free(&arena);
+    return NULL;
+}
+
+static void archive_start(struct ArchiveJob *job, int workers)
+{
+    job->next = job->emitted = job->started = 0;
+    job->rep = calloc((size_t)job->n + 1, sizeof(*job->rep));
+    job->rep_len = calloc((size_t)job->n + 1, sizeof(*job->rep_len));
+    job->done = calloc((size_t)job->n + 1, 1);
+    if (workers > job->n)
+        workers = job->n;
+    job->tids = calloc((size_t)workers + 1, sizeof(*job->tids));
+    if (!job->rep || !job->rep_len || !job->done || !job->tids)
+    {
+        fprintf(stderr, "%sERROR:%s %s: out of memory\n", PASTEL_ERROR1, COL_RESET, job->archive);
+        job->failed += (uint64_t)job->n;
+        job->n = 0;
+    }
+    for (int i = 0; job->n && i < workers; i++)
+        if (pthread_create(&job->tids[job->started], NULL, archive_worker, job) == 0)
+            job->started++;
+}
+
+static void archive_finish(struct ArchiveJob *job, struct ArchiveStats *st)
+{
+    if (job->started == 0 && job->n)
+        archive_worker(job);
+    for (int i = 0; i < job->started; i++)
+        pthread_join(job->tids[i], NULL);
+    st->sources += (uint64_t)job->n;
+    st->bytes += job->bytes;
+    st->failed += job->failed;
+    st->threads = job->started > st->threads ? job->started : st->threads;
+    free(job->rep);
+    free(job->rep_len);
+    free(job->done);
+    free(job->tids);
+    job->bytes = job->failed = 0;
+}
+
+/* analyze the sources of one archive (with extract_dir: extract them there);
+   0 if the archive cannot be read */
+static int archive_process(const char *path, int lang, int fmt, int workers, const char *extract_dir,
+                           struct ArchiveStats *st)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, path);
+        return 0;
+    }
+    size_t size = (size_t)sb.st_size;
+    const unsigned char *m = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+        fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, path);
+        return 0;
+    }
+    st->read += (double)size;
+    struct ArchiveJob job[2];
+    memset(job, 0, sizeof(job));
+    for (int k = 0; k < 2; k++)
+    {
+        job[k].archive = path;
+        job[k].lang = lang;
+        job[k].fmt = fmt;
+        job[k].extract_dir = extract_dir;
+        pthread_mutex_init(&job[k].lock, NULL);
+    }
+    struct ArchiveBatch b[2];
+    memset(b, 0, sizeof(b));
+    struct TarReader t;
+    memset(&t, 0, sizeof(t));
+    const char *why = NULL;
+    int codec = UNPACK_STORED;
+    if (size >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+        codec = UNPACK_GZIP;
+    else if (size >= 4 && le32(m) == 0xFD2FB528)
+        codec = UNPACK_ZSTD;
+    int zip = codec == UNPACK_STORED ? zip_entries(m, size, &b[0].list, &why) : 0;
+    if (zip > 0)
+    {
+        job[0].v = b[0].list.v;
+        job[0].n = b[0].list.n;
+        archive_start(&job[0], workers);
+        archive_finish(&job[0], st);
+    }
+    else if (zip == 0 && !unpack_start(&t.u, codec, m, size))
+        why = codec == UNPACK_ZSTD ? "zstd compressed, but libzstd is not available" : "out of memory";
+    else if (zip == 0)
+    {
+        long got = unpack_read(&t.u, t.hdr, 512);
+        t.have_hdr = got == 512 && (tar_header_ok(t.hdr) || tar_zero_block(t.hdr));
+        if (t.have_hdr)
+        {
+            /* fill one batch while the workers analyze the other */
+            int cur = 0, running = -1, more = 1, base = 0;
+            while (more)
+            {
+                more = tar_fill(&t, &b[cur], &why);
+                size_t off = 0;
+                for (int i = 0; i < b[cur].list.n; i++)
+                {
+                    b[cur].list.v[i].data = b[cur].buf + off;
+                    off += b[cur].list.v[i].bad ? 0 : b[cur].list.v[i].csize;
+                }
+                if (running >= 0)
+                {
+                    archive_finish(&job[running], st);
+                    archive_clear(&b[running].list);
+                    b[running].used = 0;
+                }
+                job[cur].v = b[cur].list.v;
+                job[cur].n = b[cur].list.n;
+                job[cur].base = base;
+                base += b[cur].list.n;
+                archive_start(&job[cur], workers);
+                running = cur;
+                cur ^= 1;
+                more = more > 0;
+            }
+            archive_finish(&job[running], st);
+        }
+        else if (codec != UNPACK_STORED && got >= 0)
+        {
+            /* a single compressed source: name.java.gz is entry name.java */
+            const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+            const char *dot = strrchr(base, '.');
+            size_t n = dot && (strcmp(dot, ".gz") == 0 || strcmp(dot, ".zst") == 0) ? (size_t)(dot - base) : strlen(base);
+            struct ArchiveEntry *e = archive_push(&b[0].list, base, n);
+            if (e)
+            {
+                e->data = m;
+                e->csize = size;
+                e->method = codec;
+                job[0].v = b[0].list.v;
+                job[0].n = b[0].list.n;
+                archive_start(&job[0], workers);
+                archive_finish(&job[0], st);
+            }
+            else
+                why = "out of memory";
+        }
+        else
+            why = got < 0 ? "corrupt compressed data" : "not a zip, jar or tar archive";
+    }
+    if (why)
+        fprintf(stderr, "%sERROR:%s %s: %s\n", PASTEL_ERROR1, COL_RESET, path, why);
+    for (int k = 0; k < 2; k++)
+    {
+        archive_clear(&b[k].list);
+        free(b[k].list.v);
+        free(b[k].buf);
+        pthread_mutex_destroy(&job[k].lock);
+    }
+    free(t.long_name);
+    unpack_end(&t.u);
+    if (m)
+        munmap((void *)m, size);
+    return why == NULL;
+}
+
+/* remove an extraction directory (flat: the files only) */
+static void remove_extracted(const char *dir, struct PathList *files)
+{
+    for (int i = 0; i < files->n; i++)
+    {
+        unlink(files->v[i]);
+        free(files->v[i]);
+    }
+    files->n = 0;
+    rmdir(dir);
+}
+
+/* --archive --bench N: lexing straight from the archive against extracting it
+   first (one worker, as unzip / tar would) and lexing the files; best of N */
+static int archive_bench(char **paths, int npaths, int lang, int workers, int iters)
+{
+    int status = 0;
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    for (int a = 0; a < npaths; a++)
+    {
+        double direct = 1e30, extract = 0, lex = 0;
+        struct ArchiveStats st;
+        int threads = 1, it;
+        for (it = 0; it < iters; it++)
+        {
+            memset(&st, 0, sizeof(st));
+            double t0 = now_sec();
+            if (!archive_process(paths[a], lang, -1, workers, NULL, &st))
+                break;
+            double dt = now_sec() - t0;
+            direct = dt < direct ? dt : direct;
+            threads = st.threads > threads ? st.threads : threads;
+
+            char dir[4096];
+            snprintf(dir, sizeof(dir), "%s/lexer-archive-XXXXXX", tmp);
+            if (!mkdtemp(dir))
+            {
+                fprintf(stderr, "%sERROR:%s Could not create %s\n", PASTEL_ERROR1, COL_RESET, dir);
+                break;
+            }
+            struct ArchiveStats xs;
+            memset(&xs, 0, sizeof(xs));
+            t0 = now_sec();
+            archive_process(paths[a], lang, -1, 1, dir, &xs);
+            double t1 = now_sec();
+            struct PathList files = {0};
+            walk_tree(dir, &files);
+            struct ArchiveJob job;
+            memset(&job, 0, sizeof(job));
+            job.archive = dir;
+            job.lang = lang;
+            job.fmt = -1;
+            pthread_mutex_init(&job.lock, NULL);
+            job.v = calloc((size_t)files.n + 1, sizeof(*job.v));
+            for (int i = 0; job.v && i < files.n; i++)
+            {
+                job.v[i].name = files.v[i];
+                job.v[i].method = UNPACK_FILE;
+            }
+            job.n = job.v ? files.n : 0;
+            archive_start(&job, workers);
+            archive_finish(&job, &xs);
+            double t2 = now_sec();
+            free(job.v);
+            pthread_mutex_destroy(&job.lock);
+            remove_extracted(dir, &files);
+            free(files.v);
+            if (it == 0 || t2 - t0 < extract + lex)
+            {
+                extract = t1 - t0;
+                lex = t2 - t1;
+            }
+        }
+        if (it < iters)
+        {
+            status = 1;
+            continue;
+        }
+        double mb = st.bytes / 1e6;
+        printf("%s: %llu sources, %.1f MB of source in %.1f MB\n", paths[a], (unsigned long long)st.sources, mb,
+               st.read / 1e6);
+        printf("  direct          %9.1f ms %8.0f MB/s (%d threads)\n", direct * 1e3, mb / direct, threads);
+        printf("  extract + lex   %9.1f ms %8.0f MB/s (extract %.1f ms, lex %.1f ms)\n", (extract + lex) * 1e3,
+               mb / (extract + lex), extract * 1e3, lex * 1e3);
+        printf("  speedup         %9.2fx\n", (extract + lex) / direct);
+        if (st.failed)
+            status = 1;
+    }
+    return status;
+}
+
+static int run_archive(char **paths, int npaths, int lang, int fmt, int workers, int iters)
+{
+    if (iters)
+        return archive_bench(paths, npaths, lang, workers, iters);
+    struct ArchiveStats st;
+    memset(&st, 0, sizeof(st));
+    int status = 0;
+    double t0 = now_sec();
+    for (int i = 0; i < npaths; i++)
+        if (!archive_process(paths[i], lang, fmt, workers, NULL, &st))
+            status = 1;
+    double wall = now_sec() - t0;
+    fflush(stdout);
+    fprintf(stderr, "archive: %d archives, %.1f MB read, %llu sources (%.1f MB) in %.1f ms (%.0f MB/s, %d threads), %llu failed\n",
+            npaths, st.read / 1e6, (unsigned long long)st.sources, st.bytes / 1e6, wall * 1e3, st.bytes / 1e6 / wall,
+            st.threads ? st.threads : 1, (unsigned long long)st.failed);
+    return status || st.failed ? 1 : 0;
+}
+
+/* ---------- Persistent analysis server (Unix domain socket) ----------
+   A connection may carry any number of requests (batched, answered in order):
+     request:  <lang> <format> PATH <path>\n
+               <lang> <format> BUF <length> [name]\n followed by <length> bytes
+               QUIT\n
+     response: OK <length>\n followed by <length> bytes of report
+               ERR <message>\n
+   lang is java|kotlin|auto, format is box|tsv|summary|docs.
+*/
+#define SERVE_MAX_BUF (1u << 30) /* larger BUF payloads are refused */
+
+static void serve_connection(int fd)
+{
+    /* per-worker buffers, grown to the high-water mark and reused */
+    static __thread char *src;
+    static __thread size_t src_cap;
+    static __thread FILE *rep;
+    static __thread char *rep_buf;
+    static __thread size_t rep_size;
+
+    int wfd = dup(fd);
+    FILE *in = fdopen(fd, "r");
+    FILE *out = wfd >= 0 ? fdopen(wfd, "w") : NULL;
+    if (!rep)
+        rep = open_memstream(&rep_buf, &rep_size);
+    if (!in || !out || !rep)
+    {
+        if (in)
+            fclose(in);
+        else
+            close(fd);
+        if (out)
+            fclose(out);
+        else if (wfd >= 0)
+            close(wfd);
+        return;
+    }
+
+    char hdr[4096];
+    while (fgets(hdr, sizeof(hdr), in))
+    {
+        trim_inplace(hdr);
+        if (strlen(hdr) == 0)
+            continue;
+        if (strcmp(hdr, "QUIT") == 0)
+            break;
+
+        char lang_s[16], fmt_s[16], kind[8];
+        int off = 0;
+        if (sscanf(hdr, "%15s %15s %7s %n", lang_s, fmt_s, kind, &off) < 3 || off == 0 || hdr[off] == 0)
+        {
+            /* cannot know how much payload follows: drop the connection */
+            fprintf(out, "ERR malformed request\n");
+            break;
+        }
+        const char *arg = hdr + off;
+        const char *name = arg;
+        const char *buf = NULL;
+        size_t len = 0;
+        if (strcmp(kind, "BUF") == 0)
+        {
+            char *end;
+            len = strtoul(arg, &end, 10);
+            if (end == arg || *arg == '-' || len > SERVE_MAX_BUF)
+            {
+                /* the payload size is unknown: drop the connection */
+                fprintf(out, "ERR bad buffer length (at most %u bytes)\n", SERVE_MAX_BUF);
+                break;
+            }
+            while (*end == ' ')
+                end++;
+            name = *end ? end : "<buffer>";
+            if (len + 1 > src_cap)
+            {
+                char *grown = realloc(src, len + 1);
+                if (!grown)
+                {
+                    fprintf(out, "ERR out of memory\n");
+                    break;
+                }
+                src = grown;
+                src_cap = len + 1;
+            }
+            if (fread(src, 1, len, in) != len)
+                break;
+            buf = src;
+        }
+        else if (strcmp(kind, "PATH") != 0)
+        {
+            fprintf(out, "ERR unknown request kind '%s'\n", kind);
+            fflush(out);
+            continue;
+        }
+
+        int lang = parse_lang(lang_s), fmt = parse_format(fmt_s);
+        if (lang < 0 || fmt < 0)
+        {
+            fprintf(out, "ERR unknown %s '%s'\n", lang < 0 ? "language" : "format", lang < 0 ? lang_s : fmt_s);
+            fflush(out);
+            continue;
+        }
+        if (fmt == FMT_DOCS && !keep_comments)
+        {
+            fprintf(out, "ERR format docs needs comments (server runs with --no-comments)\n");
+            fflush(out);
+            continue;
+        }
+
+        fseek(rep, 0, SEEK_SET);
+        int ok = analyze_source(name, buf, len, lang, fmt, rep);
+        fflush(rep);
+        long n = ftell(rep);
+        if (ok)
+        {
+            fprintf(out, "OK %ld\n", n);
+            fwrite(rep_buf, 1, (size_t)n, out);
+        }
+        else
+            fprintf(out, "ERR could not open %s\n", name);
+        if (fflush(out) != 0)
+            break;
+    }
+    fclose(in);
+    fclose(out);
+}
+
+static void *server_worker(void *arg)
+{
+    int lfd = *(const int *)arg;
+    while (1)
+    {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        serve_connection(fd);
+    }
+    return NULL;
+}
+
+static int run_server(const char *sock_path, int workers)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "socket path too long: %s\n", sock_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    signal(SIGPIPE, SIG_IGN); /* a client hanging up must not kill the server */
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    unlink(sock_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 256) < 0)
+    {
+        perror(sock_path);
+        close(lfd);
+        return 1;
+    }
+
+    pthread_t *tids = calloc((size_t)workers, sizeof(*tids));
+    if (!tids)
+    {
+        close(lfd);
+        return 1;
+    }
+    int started = 0;
+    for (int i = 0; i < workers; i++)
+        if (pthread_create(&tids[started], NULL, server_worker, &lfd) == 0)
+            started++;
+    fprintf(stderr, "Serving on %s with %d workers\n", sock_path, started);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    close(lfd);
+    unlink(sock_path);
+    return started ? 0 : 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s                                   interactive mode\n"
+            "       %s [--format box|tsv|summary|docs] [--lang java|kotlin|auto] [--no-comments] FILE...\n"
+            "       %s --serve SOCKET [--workers N] [--no-comments]\n"
+            "       %s --bench ITERATIONS [--lang java|kotlin|auto] FILE...\n"
+            "       %s --stress MB [--lang java|kotlin]        adversarial inputs, fails if analysis is not linear\n"
+            "       %s --index INDEX [--workers N] PATH...    build the index; on an existing INDEX, update only PATH...\n"
+            "       %s --index-query INDEX NAME...             (or --bench N without names)\n"
+            "       %s --pipeline [--depth N] [--format F] PATH...  staged read/lex/analyze/write\n"
+            "       %s --diff [--bench N] OLD NEW           token-level diff (bench: vs plain Myers)\n"
+            "       %s --clones [--kgram K] [--winnow W] [--min-tokens M] [--budget FINGERPRINTS] [--workers N] PATH...\n"
+            "       %s --find \"KIND:text KIND ...\" [--workers N] PATH...  e.g. \"KEYWORD:when IDENTIFIER\"\n"
+            "       %s --highlight ansi|html [--bench N] FILE...  colored source (bench: render throughput)\n"
+            "       %s --archive [--workers N] [--format F] [--bench N] ARCHIVE...  jar/zip/tar[.gz|.zst] (bench: vs extracting)\n"
+            "   --project INDEX resolves identifiers against the index in analysis and --serve\n",
+            prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+/* non-interactive entry point */
+static int run_cli(int argc, char **argv)
+{
+    int fmt = FMT_BOX, lang = LANG_AUTO, status = 0;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN), bench_iters = 0, pipeline_depth = 0, diff = 0;
+    int clones = 0, kgram = 30, winnow = 10, min_tokens = 100, stress_mb = 0;
+    long budget = 4000000;
+    const char *sock_path = NULL, *index_path = NULL, *query_path = NULL, *project_path = NULL;
+    char *find_pattern = NULL;
+    const char *highlight = NULL;
+    int archive = 0;
+    int first_file = argc;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            fmt = parse_format(argv[++i]);
+        else if (strcmp(argv[i], "--lang") == 0 && i + 1 < argc)
+            lang = parse_lang(argv[++i]);
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            sock_path = argv[++i];
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-comments") == 0)
+            keep_comments = 0;
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            bench_iters = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stress") == 0 && i + 1 < argc)
+            stress_mb = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc)
+            index_path = argv[++i];
+        else if (strcmp(argv[i], "--index-query") == 0 && i + 1 < argc)
+            query_path = argv[++i];
+        else if (strcmp(argv[i], "--project") == 0 && i + 1 < argc)
+            project_path = argv[++i];
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            pipeline_depth = pipeline_depth ? pipeline_depth : 8;
+        else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+            pipeline_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--diff") == 0)
+            diff = 1;
+        else if (strcmp(argv[i], "--find") == 0 && i + 1 < argc)
+            find_pattern = argv[++i];
+        else if (strcmp(argv[i], "--highlight") == 0 && i + 1 < argc)
+            highlight = argv[++i];
+        else if (strcmp(argv[i], "--clones") == 0)
+            clones = 1;
+        else if (strcmp(argv[i], "--archive") == 0)
+            archive = 1;
+        else if (strcmp(argv[i], "--kgram") == 0 && i + 1 < argc)
+            kgram = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--winnow") == 0 && i + 1 < argc)
+            winnow = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--min-tokens") == 0 && i + 1 < argc)
+            min_tokens = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+            budget = atol(argv[++i]);
+        else if (argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else
+        {
+            first_file = i;
+            break;
+        }
+    }
+    if (fmt < 0 || lang < 0 || workers < 1 || bench_iters < 0 || pipeline_depth < 0 || kgram < 1 || winnow < 1 || min_tokens < 0 || budget < 1 || stress_mb < 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (fmt == FMT_DOCS && !keep_comments)
+    {
+        fprintf(stderr, "%sERROR:%s --format docs needs the doc comments that --no-comments skips\n", PASTEL_ERROR1, COL_RESET);
+        return 2;
+    }
+    if (query_path)
+        return run_index_query(query_path, argv + first_file, argc - first_file, bench_iters);
+    if (project_path)
+    {
+        static struct ProjectIndex project_index;
+        if (!index_open(&project_index, project_path))
+        {
+            fprintf(stderr, "%sERROR:%s Could not open index %s\n", PASTEL_ERROR1, COL_RESET, project_path);
+            return 1;
+        }
+        project = &project_index;
+    }
+    if (sock_path)
+        return run_server(sock_path, workers);
+    if (stress_mb)
+        return run_stress(stress_mb, lang);
+    if (first_file == argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (diff)
+    {
+        if (argc - first_file != 2)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        return run_diff(argv[first_file], argv[first_file + 1], lang, bench_iters);
+    }
+    if (highlight)
+        return run_highlight(highlight, argv + first_file, argc - first_file, lang, bench_iters);
+    if (archive)
+        return run_archive(argv + first_file, argc - first_file, lang, fmt, workers, bench_iters);
+    if (find_pattern)
+        return run_find(find_pattern, argv + first_file, argc - first_file, lang, workers);
+    if (clones)
+        return run_clones(argv + first_file, argc - first_file, workers, kgram, winnow, min_tokens, (size_t)budget);
+    if (index_path)
+        return run_index_build(index_path, argv + first_file, argc - first_file, workers);
+    if (pipeline_depth)
+        return run_pipeline(argv + first_file, argc - first_file, lang, fmt, pipeline_depth);
+    if (bench_iters)
+        return run_bench(argv + first_file, argc - first_file, lang, bench_iters);
+    for (int i = first_file; i < argc; i++)
+    {
+        if (!analyze_source(argv[i], NULL, 0, lang, fmt, stdout))
+        {
+            fprintf(stderr, "%sERROR:%s Could not open %s\n", PASTEL_ERROR1, COL_RESET, argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* main loop */
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        return run_cli(argc, argv);
+
     char filename[256];
+    animate = 1;
     printf("%sLexical Analyzer for Java and Kotlin %s\n", PASTEL_HDR_BG, COL_RESET);
     while (1)
     {
@@ -929,9 +5642,9 @@ int main(void)
                2) Comments
                3) Errors
             */
-            print_symbol_table_box();
-            print_comments_box(filename);
-            print_errors_and_summary_box();
+            print_symbol_table_box(stdout);
+            print_comments_box(stdout, filename);
+            print_errors_and_summary_box(stdout);
         }
 
         if (!prompt_yesno("Do you want to continue and analyze another file"))